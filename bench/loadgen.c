@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * HTTP/1.1 load generator.
+ *
+ * Keeps a fixed number of persistent connections to the server and sends GET
+ * requests for the given paths in turn, one request in flight per connection.
+ *
+ * Closed loop (the default): each connection sends its next request as soon
+ * as the previous response is in, so we measure how fast the server can go.
+ *
+ * Open loop (-r): requests are due at a fixed rate regardless of how fast the
+ * server answers. A request that is due while every connection is busy waits
+ * for one, and its latency counts from when it was due, so a stalled server
+ * shows up in the percentiles instead of just slowing down the load.
+ *
+ * Prints one line of JSON with throughput and latency percentiles, and exits
+ * nonzero unless every request got a successful response, so that -q -n 1
+ * doubles as a readiness check.
+ */
+
+#define MAX_EVENTS 64
+#define BUF_SIZE 65536
+#define MAX_PATHS 256
+
+struct client {
+    int fd; // -1 if not connected
+    int busy;            // request in flight
+    long long start_us;  // when the request in flight was sent (or due)
+    char buf[BUF_SIZE];  // response headers
+    size_t len;
+    long long body_left; // body bytes still to come, or -1 while in headers
+    int close_after;     // server will close after this response
+};
+
+static const char *paths[MAX_PATHS];
+static int npaths;
+static int next_path;
+static const char *host_header;
+
+static struct sockaddr_storage addr;
+static socklen_t addr_len;
+static int epfd;
+
+static unsigned *latencies; // microseconds, per completed request
+static size_t nlatencies, latencies_cap;
+static unsigned long long errors, bytes;
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void die(const char *message)
+{
+    perror(message);
+    exit(1);
+}
+
+static int client_connect(struct client *cl)
+{
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0)
+        die("socket");
+
+    // Loopback connects complete right away; only then go non-blocking.
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = cl };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        die("epoll_ctl");
+
+    cl->fd = fd;
+    cl->busy = 0;
+    cl->len = 0;
+    return 0;
+}
+
+static void client_close(struct client *cl)
+{
+    if (cl->fd >= 0)
+        close(cl->fd);
+    cl->fd = -1;
+    cl->busy = 0;
+}
+
+/*
+ * Send the next request on cl, counting its latency from start_us.
+ *
+ * Returns negative if failed.
+ */
+static int client_send(struct client *cl, long long start_us)
+{
+    if (cl->fd < 0 && client_connect(cl) < 0)
+        return -1;
+
+    char req[1024];
+    int n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+            paths[next_path], host_header);
+    next_path = (next_path + 1) % npaths;
+
+    // Requests are tiny, so they always fit in an idle socket's buffer.
+    if (send(cl->fd, req, n, MSG_NOSIGNAL) != n) {
+        client_close(cl);
+        return -1;
+    }
+
+    cl->busy = 1;
+    cl->start_us = start_us;
+    cl->len = 0;
+    cl->body_left = -1;
+    cl->close_after = 0;
+    return 0;
+}
+
+static void record(unsigned us)
+{
+    if (nlatencies == latencies_cap) {
+        latencies_cap = latencies_cap ? latencies_cap * 2 : 65536;
+        latencies = realloc(latencies, latencies_cap * sizeof(*latencies));
+        if (latencies == NULL)
+            die("realloc");
+    }
+    latencies[nlatencies++] = us;
+}
+
+/*
+ * Parse the response headers in cl->buf, once they are all there.
+ *
+ * Returns the length of the headers, 0 if incomplete, or negative if the
+ * response is malformed or an error.
+ */
+static long parse_headers(struct client *cl)
+{
+    char *end = memmem(cl->buf, cl->len, "\r\n\r\n", 4);
+    if (end == NULL)
+        return cl->len == sizeof(cl->buf) ? -1 : 0;
+    *end = '\0';
+
+    int status;
+    if (sscanf(cl->buf, "HTTP/1.%*d %d", &status) != 1)
+        return -1;
+    if (status >= 400)
+        errors++;
+
+    char *cl_hdr = strcasestr(cl->buf, "\r\nContent-Length:");
+    cl->body_left = cl_hdr ? atoll(cl_hdr + strlen("\r\nContent-Length:")) : 0;
+    cl->close_after = strcasestr(cl->buf, "\r\nConnection: close") != NULL;
+
+    return end + 4 - cl->buf;
+}
+
+/*
+ * Read what the server sent on cl.
+ *
+ * Returns 1 if the response is complete, 0 if not yet, or negative if the
+ * connection failed.
+ */
+static int client_read(struct client *cl)
+{
+    for (;;) {
+        char *dst = cl->body_left < 0 ? cl->buf + cl->len : cl->buf;
+        size_t room = cl->body_left < 0 ? sizeof(cl->buf) - cl->len : sizeof(cl->buf);
+
+        ssize_t n = recv(cl->fd, dst, room, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0 || !cl->busy)
+            return -1;
+        bytes += n;
+
+        if (cl->body_left < 0) {
+            cl->len += n;
+            long hdr_len = parse_headers(cl);
+            if (hdr_len < 0)
+                return -1;
+            if (hdr_len == 0)
+                continue;
+            n = cl->len - hdr_len; // body bytes that came with the headers
+        }
+
+        // The body only needs counting, not keeping.
+        cl->body_left -= n;
+        if (cl->body_left <= 0)
+            return 1;
+    }
+}
+
+static int percentile_cmp(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return (x > y) - (x < y);
+}
+
+static unsigned percentile(double p)
+{
+    if (nlatencies == 0)
+        return 0;
+    return latencies[(size_t)(p * (nlatencies - 1))];
+}
+
+int main(int argc, char *argv[])
+{
+    int nconns = 16;
+    double duration = 5;
+    long long max_requests = 0; // 0 means no limit
+    double rate = 0;            // requests per second; 0 means closed loop
+    const char *scenario = "default";
+    int quiet = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:n:r:s:p:q")) != -1) {
+        switch (opt) {
+        case 'c': // connections
+            nconns = atoi(optarg);
+            if (nconns <= 0)
+                goto usage;
+            break;
+        case 'd': // seconds to run for
+            duration = atof(optarg);
+            break;
+        case 'n': // stop after this many requests
+            max_requests = atoll(optarg);
+            break;
+        case 'r': // open loop at this many requests per second
+            rate = atof(optarg);
+            break;
+        case 's': // scenario name for the report
+            scenario = optarg;
+            break;
+        case 'p': // path to request; may be repeated
+            if (npaths == MAX_PATHS)
+                goto usage;
+            paths[npaths++] = optarg;
+            break;
+        case 'q': // no report
+            quiet = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (argc - optind != 2 || npaths == 0) {
+usage:
+        fprintf(stderr, "usage: %s [-c <conns>] [-d <secs>] [-n <requests>] [-r <rate>] "
+                "[-s <scenario>] [-q] -p <path> [-p <path>...] <host> <port>\n", argv[0]);
+        exit(1);
+    }
+
+    host_header = argv[optind];
+
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    int addr_err;
+    if ((addr_err = getaddrinfo(argv[optind], argv[optind + 1], &hints, &info)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(addr_err));
+        exit(1);
+    }
+    memcpy(&addr, info->ai_addr, info->ai_addrlen);
+    addr_len = info->ai_addrlen;
+    freeaddrinfo(info);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        die("epoll_create1");
+
+    struct client *clients = calloc(nconns, sizeof(*clients));
+    if (clients == NULL)
+        die("calloc");
+    for (int i = 0; i < nconns; i++) {
+        clients[i].fd = -1;
+        if (client_connect(&clients[i]) < 0) {
+            if (!quiet)
+                perror("connect");
+            exit(1);
+        }
+    }
+
+    // Open loop: requests that came due while every connection was busy.
+    long long *backlog = NULL;
+    size_t backlog_head = 0, backlog_len = 0, backlog_cap = 0;
+
+    long long start = now_us();
+    long long end = start + (long long)(duration * 1e6);
+    long long next_due = start;
+    long long sent = 0;
+    int inflight = 0;
+
+    if (rate <= 0) {
+        for (int i = 0; i < nconns && (!max_requests || sent < max_requests); i++) {
+            if (client_send(&clients[i], now_us()) < 0)
+                errors++;
+            else
+                sent++, inflight++;
+        }
+    }
+
+    for (;;) {
+        long long now = now_us();
+        int stopping = now >= end || (max_requests && sent >= max_requests);
+
+        if (stopping && inflight == 0)
+            break;
+        // Give outstanding requests a moment, but don't wait on a hung server.
+        if (now >= end + 2000000)
+            break;
+
+        // Open loop: queue every request that has come due.
+        while (rate > 0 && !stopping && next_due <= now) {
+            if (backlog_len == backlog_cap) {
+                size_t cap = backlog_cap ? backlog_cap * 2 : 1024;
+                long long *b = malloc(cap * sizeof(*b));
+                if (b == NULL)
+                    die("malloc");
+                for (size_t i = 0; i < backlog_len; i++)
+                    b[i] = backlog[(backlog_head + i) % backlog_cap];
+                free(backlog);
+                backlog = b;
+                backlog_head = 0;
+                backlog_cap = cap;
+            }
+            backlog[(backlog_head + backlog_len++) % backlog_cap] = next_due;
+            next_due += (long long)(1e6 / rate);
+            sent++;
+            stopping = max_requests && sent >= max_requests;
+        }
+
+        for (int i = 0; i < nconns && backlog_len > 0; i++) {
+            if (clients[i].busy)
+                continue;
+            long long due = backlog[backlog_head];
+            backlog_head = (backlog_head + 1) % backlog_cap;
+            backlog_len--;
+            if (client_send(&clients[i], due) < 0)
+                errors++;
+            else
+                inflight++;
+        }
+
+        int timeout = 100;
+        if (rate > 0 && !stopping)
+            timeout = next_due > now ? (next_due - now + 999) / 1000 : 0;
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct client *cl = events[i].data.ptr;
+            if (cl->fd < 0)
+                continue;
+
+            int rc = client_read(cl);
+            if (rc == 0)
+                continue;
+
+            if (cl->busy)
+                inflight--;
+            if (rc < 0) {
+                errors++;
+                client_close(cl);
+            } else {
+                long long t = now_us();
+                record(t - cl->start_us > 0xffffffffLL ? 0xffffffffu : t - cl->start_us);
+                cl->busy = 0;
+                if (cl->close_after)
+                    client_close(cl);
+            }
+
+            // Closed loop: go again right away.
+            if (rate <= 0 && now_us() < end && (!max_requests || sent < max_requests)) {
+                if (client_send(cl, now_us()) < 0)
+                    errors++;
+                else
+                    sent++, inflight++;
+            }
+        }
+    }
+
+    double elapsed = (now_us() - start) / 1e6;
+    qsort(latencies, nlatencies, sizeof(*latencies), &percentile_cmp);
+
+    if (!quiet) {
+        printf("{\"scenario\":\"%s\",\"mode\":\"%s\",\"conns\":%d,\"rate\":%g,"
+                "\"duration_s\":%.3f,\"requests\":%zu,\"errors\":%llu,\"bytes\":%llu,"
+                "\"rps\":%.1f,\"p50_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u}\n",
+                scenario, rate > 0 ? "open" : "closed", nconns, rate, elapsed,
+                nlatencies, errors, bytes, nlatencies / elapsed,
+                percentile(0.50), percentile(0.99), percentile(0.999),
+                nlatencies ? latencies[nlatencies - 1] : 0);
+    }
+
+    return nlatencies > 0 && errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../part1/mdb.h"
+
+/*
+ * Generate a synthetic database of records.
+ *
+ * Names and messages are made of pronounceable syllables and words, so that
+ * substring lookups hit a realistic spread of records, and the same seed
+ * always gives the same file.
+ */
+
+static uint64_t rng_state;
+
+// xorshift64*
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 2685821657736338717ULL) >> 32;
+}
+
+static const char *syllables[] = {
+    "al", "be", "cor", "da", "el", "fi", "gar", "ha", "in", "jo", "ka", "li",
+    "mo", "na", "or", "pe", "qui", "ra", "si", "to", "ul", "ve", "wi", "xa",
+    "yo", "ze",
+};
+
+static const char *words[] = {
+    "hello", "world", "lunch", "at", "noon", "see", "you", "later", "meeting",
+    "moved", "to", "room", "happy", "birthday", "thanks", "for", "the", "help",
+    "build", "is", "broken", "again", "coffee", "anyone", "ship", "it",
+};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+/*
+ * Fill field (of width bytes, NUL-terminated) with parts picked from list,
+ * separated by sep.
+ */
+static void fill(char *field, size_t width, const char **list, size_t n, int parts,
+        const char *sep)
+{
+    memset(field, 0, width);
+    size_t len = 0;
+
+    for (int i = 0; i < parts; i++) {
+        const char *part = list[rng() % n];
+        size_t need = strlen(part) + (i ? strlen(sep) : 0);
+        if (len + need > width - 1)
+            break;
+        if (i) {
+            strcpy(field + len, sep);
+            len += strlen(sep);
+        }
+        strcpy(field + len, part);
+        len += strlen(part);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's': // seed; the same seed gives the same records
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (argc - optind != 2) {
+usage:
+        fprintf(stderr, "usage: %s [-s <seed>] <records> <database>\n", argv[0]);
+        exit(1);
+    }
+
+    long records = atol(argv[optind]);
+    const char *database = argv[optind + 1];
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1; // never zero
+
+    FILE *fp = fopen(database, "wb");
+    if (fp == NULL) {
+        perror(database);
+        exit(1);
+    }
+
+    for (long i = 0; i < records; i++) {
+        struct MdbRec r;
+        fill(r.name, sizeof(r.name), syllables, NELEMS(syllables), 2 + rng() % 3, "");
+        fill(r.msg, sizeof(r.msg), words, NELEMS(words), 2 + rng() % 4, " ");
+        if (fwrite(&r, sizeof(r), 1, fp) != 1) {
+            perror(database);
+            exit(1);
+        }
+    }
+
+    if (fclose(fp) != 0) {
+        perror(database);
+        exit(1);
+    }
+    return 0;
+}
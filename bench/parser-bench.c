@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../part2/http-parser.h"
+
+/*
+ * Microbenchmark for the HTTP request parser.
+ *
+ * Parses a few typical requests over and over, once with each request
+ * arriving whole and once with it trickling in a few bytes at a time, and
+ * prints one line of JSON per case with the time per request and the
+ * throughput.
+ */
+
+static const struct {
+    const char *name;
+    const char *text;
+} requests[] = {
+    { "minimal",
+        "GET / HTTP/1.0\r\n\r\n" },
+    { "lookup",
+        "GET /mdb-lookup?key=hello HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "\r\n" },
+    { "browser",
+        "GET /images/logo.png HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: image/avif,image/webp,image/png,image/svg+xml,image/*;q=0.8,*/*;q=0.5\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Referer: https://www.example.com/index.html\r\n"
+        "Connection: keep-alive\r\n"
+        "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; lang=en\r\n"
+        "Sec-Fetch-Dest: image\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "If-Modified-Since: Tue, 15 Oct 2024 08:12:31 GMT\r\n"
+        "If-None-Match: \"5f3a-1b2c-64a1f0\"\r\n"
+        "\r\n" },
+};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Parse text iterations times, handing the parser chunk more bytes at a time
+ * (all of it at once if chunk is 0).
+ */
+static void run(const char *name, const char *text, long iterations, size_t chunk)
+{
+    size_t len = strlen(text);
+    struct http_parser p;
+    size_t headers = 0;
+
+    double start = now();
+    for (long i = 0; i < iterations; i++) {
+        http_parser_init(&p, 8192);
+        int rc = 0;
+        for (size_t have = chunk ? chunk : len; rc == 0; have += chunk) {
+            rc = http_parse(&p, text, have < len ? have : len);
+            if (have >= len)
+                break;
+        }
+        if (rc != 200) {
+            fprintf(stderr, "%s: parse failed with %d\n", name, rc);
+            exit(1);
+        }
+        headers += p.nheaders; // keep the work from being optimized away
+    }
+    double elapsed = now() - start;
+
+    printf("{\"case\":\"%s\",\"chunk\":%zu,\"bytes\":%zu,\"headers\":%zu,\"iterations\":%ld,"
+            "\"ns_per_request\":%.1f,\"mb_per_s\":%.1f}\n",
+            name, chunk, len, headers / iterations, iterations,
+            elapsed * 1e9 / iterations, len * iterations / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': // iterations per case
+            iterations = atol(optarg);
+            if (iterations <= 0)
+                goto usage;
+            break;
+        default:
+usage:
+            fprintf(stderr, "usage: %s [-n <iterations>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    for (size_t i = 0; i < NELEMS(requests); i++) {
+        run(requests[i].name, requests[i].text, iterations, 0);
+        run(requests[i].name, requests[i].text, iterations / 4, 16);
+    }
+    return 0;
+}
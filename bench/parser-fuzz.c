@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../part2/http-parser.h"
+
+/*
+ * Fuzz harness for the HTTP request parser.
+ *
+ * Each input is parsed twice: all at once, and a byte at a time as if every
+ * byte came in its own read. Both must come to the same result, and every
+ * slice of a parsed request must lie within its request line and headers.
+ * Anything else aborts.
+ *
+ * With libFuzzer:
+ *     clang -g -O1 -fsanitize=fuzzer,address -DUSE_LIBFUZZER \
+ *         parser-fuzz.c ../part2/http-parser.c
+ *
+ * Without it, the built-in driver runs the files named on the command line,
+ * or else random mutations of a few sample requests.
+ */
+
+#define MAX_LEN 1024 // small, so that the size limits get hit too
+
+static void check(int ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "parser-fuzz: %s\n", what);
+        abort();
+    }
+}
+
+static void check_slice(struct http_slice s, const char *buf, size_t header_len)
+{
+    check(s.p >= buf && s.p + s.len <= buf + header_len, "slice outside the headers");
+}
+
+static int same_slice(struct http_slice a, const char *abuf, struct http_slice b,
+        const char *bbuf)
+{
+    return a.p - abuf == b.p - bbuf && a.len == b.len;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    // A copy of exactly the input size, so that reading past it gets caught.
+    char *buf = malloc(size ? size : 1);
+    if (buf == NULL)
+        return 0;
+    memcpy(buf, data, size);
+
+    struct http_parser whole, bytes;
+
+    http_parser_init(&whole, MAX_LEN);
+    int rc = http_parse(&whole, buf, size);
+
+    http_parser_init(&bytes, MAX_LEN);
+    int rc_bytes = 0;
+    for (size_t n = 0; n <= size && rc_bytes == 0; n++)
+        rc_bytes = http_parse(&bytes, buf, n);
+
+    check(rc == rc_bytes, "result depends on how the input was split");
+    check(rc == 0 || rc == 200 || rc == 400 || rc == 414 || rc == 431, "unexpected status");
+    check(rc != 0 || size < MAX_LEN, "no result though the limit was reached");
+
+    if (rc == 200) {
+        check(whole.header_len <= size && whole.header_len <= MAX_LEN, "headers too long");
+        check(whole.header_len == bytes.header_len, "header length differs");
+        check(whole.method.len > 0 && whole.uri.len > 0 && whole.version.len > 0,
+                "empty request line part");
+        check(whole.nheaders >= 0 && whole.nheaders <= HTTP_MAX_HEADERS, "header count");
+        check(whole.nheaders == bytes.nheaders, "header count differs");
+
+        check_slice(whole.method, buf, whole.header_len);
+        check_slice(whole.uri, buf, whole.header_len);
+        check_slice(whole.version, buf, whole.header_len);
+        check(same_slice(whole.uri, buf, bytes.uri, buf), "request URI differs");
+
+        for (int i = 0; i < whole.nheaders; i++) {
+            const struct http_header *h = &whole.headers[i];
+            check_slice(h->name, buf, whole.header_len);
+            check_slice(h->value, buf, whole.header_len);
+            check(h->name.len > 0, "empty header name");
+            check(same_slice(h->name, buf, bytes.headers[i].name, buf)
+                    && same_slice(h->value, buf, bytes.headers[i].value, buf),
+                    "header differs");
+            check(memchr(h->value.p, '\n', h->value.len) == NULL, "line end in a value");
+        }
+
+        // Parsing more input once done doesn't change anything.
+        check(http_parse(&whole, buf, size) == 200 && whole.header_len == bytes.header_len,
+                "parsing after the end");
+    }
+
+    free(buf);
+    return 0;
+}
+
+#ifndef USE_LIBFUZZER
+
+static const char *seeds[] = {
+    "GET / HTTP/1.0\r\n\r\n",
+    "GET /mdb-lookup?key=hello HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n",
+    "POST /mdb-add HTTP/1.1\r\nContent-Length: 16\r\n\r\nname=al&msg=hi",
+    "\r\n\nGET /a%20b.html HTTP/1.1\nAccept-Encoding: gzip;q=0.5, *\n\n",
+    "GET /index.html HTTP/1.1\r\nIf-None-Match: \"abc\"\r\nX-Empty:\r\n  \r\n\r\n",
+};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+static uint64_t rng_state = 1;
+
+// xorshift64*
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 2685821657736338717ULL) >> 32;
+}
+
+/*
+ * Make a random change to the len bytes in buf, which has room for cap.
+ *
+ * Returns the new length.
+ */
+static size_t mutate(uint8_t *buf, size_t len, size_t cap)
+{
+    static const char interesting[] = "\r\n :\t\0\x7f\x80/HTTP";
+    size_t pos = len ? rng() % len : 0;
+
+    switch (rng() % 5) {
+    case 0: // flip a bit
+        if (len)
+            buf[pos] ^= 1 << (rng() % 8);
+        break;
+    case 1: // overwrite with a character the parser cares about
+        if (len)
+            buf[pos] = interesting[rng() % (sizeof(interesting) - 1)];
+        break;
+    case 2: // insert a run of one byte
+        {
+            size_t n = 1 + rng() % 64;
+            if (len + n > cap)
+                break;
+            memmove(buf + pos + n, buf + pos, len - pos);
+            memset(buf + pos, interesting[rng() % (sizeof(interesting) - 1)], n);
+            len += n;
+        }
+        break;
+    case 3: // delete a few bytes
+        {
+            size_t n = 1 + rng() % 8;
+            if (pos + n > len)
+                n = len - pos;
+            memmove(buf + pos, buf + pos + n, len - pos - n);
+            len -= n;
+        }
+        break;
+    case 4: // cut short
+        len = pos;
+        break;
+    }
+    return len;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n': // random inputs to try
+            iterations = atol(optarg);
+            break;
+        case 's': // seed for the random inputs
+            rng_state = strtoull(optarg, NULL, 10) * 0x9E3779B97F4A7C15ULL + 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n <iterations>] [-s <seed>] [<input>...]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // Inputs given as files.
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            FILE *fp = fopen(argv[i], "rb");
+            if (fp == NULL) {
+                perror(argv[i]);
+                exit(1);
+            }
+            static uint8_t buf[1 << 20];
+            size_t len = fread(buf, 1, sizeof(buf), fp);
+            fclose(fp);
+            LLVMFuzzerTestOneInput(buf, len);
+        }
+        return 0;
+    }
+
+    uint8_t buf[2 * MAX_LEN];
+    for (long i = 0; i < iterations; i++) {
+        const char *seed = seeds[rng() % NELEMS(seeds)];
+        size_t len = strlen(seed);
+        memcpy(buf, seed, len);
+
+        for (int n = 1 + rng() % 8; n > 0; n--)
+            len = mutate(buf, len, sizeof(buf));
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+
+    printf("parser-fuzz: %ld inputs, no failures\n", iterations);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# End-to-end benchmark: builds both servers, generates a database and a web
+# root, starts mdb-lookup-server and http-server on loopback, and runs each
+# scenario through loadgen. Prints one line of JSON per scenario, and appends
+# the same lines to $BENCH_OUT if set.
+#
+# Knobs (environment): RECORDS, DURATION (secs per scenario), CONNS, RATE
+# (requests/sec for the open-loop scenario), WORKERS, MDB_PORT, HTTP_PORT
+# (three consecutive ports from here), BENCH_OUT.
+
+set -e
+
+RECORDS=${RECORDS:-100000}
+DURATION=${DURATION:-5}
+CONNS=${CONNS:-32}
+RATE=${RATE:-2000}
+WORKERS=${WORKERS:-$(nproc)}
+MDB_PORT=${MDB_PORT:-17454}
+HTTP_PORT=${HTTP_PORT:-17455}
+# mdb-lookup-server serves any number of backend connections; its workers
+# only answer lookups, so one per CPU will do.
+MDB_WORKERS=$WORKERS
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH")
+
+make -s -C "$ROOT/part1"
+make -s -C "$ROOT/part2"
+make -s -C "$BENCH" default
+
+TMP=$(mktemp -d)
+PIDS=
+cleanup() {
+    for pid in $PIDS; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+# Data: a synthetic database and a web root of mixed file sizes.
+"$BENCH/mdb-gen" "$RECORDS" "$TMP/bench.mdb"
+mkdir "$TMP/www"
+echo '<html><body>benchmark</body></html>' > "$TMP/www/index.html"
+head -c 1024 /dev/urandom | base64 -w 76 | head -c 1024 > "$TMP/www/1k.html"
+head -c 12288 /dev/urandom | base64 -w 76 | head -c 16384 > "$TMP/www/16k.html"
+head -c 262144 /dev/urandom > "$TMP/www/256k.bin"
+head -c 4194304 /dev/urandom > "$TMP/www/4m.bin"
+
+# Servers: A caches lookups, B and C go to the backend every time over the
+# text and the binary protocol.
+HTTP_A=$HTTP_PORT
+HTTP_B=$((HTTP_PORT + 1))
+HTTP_C=$((HTTP_PORT + 2))
+
+"$ROOT/part1/mdb-lookup-server" -w "$MDB_WORKERS" "$MDB_PORT" "$TMP/bench.mdb" \
+    > "$TMP/mdb-lookup-server.out" 2>&1 &
+PIDS="$PIDS $!"
+
+start_http() {
+    port=$1
+    shift
+    "$ROOT/part2/http-server" --workers "$WORKERS" --access-log /dev/null "$@" \
+        "$port" "$TMP/www" localhost "$MDB_PORT" > "$TMP/http-server-$port.out" 2>&1 &
+    PIDS="$PIDS $!"
+}
+
+wait_ready() {
+    tries=0
+    until "$BENCH/loadgen" -q -c 1 -n 1 -p "$2" localhost "$1"; do
+        tries=$((tries + 1))
+        if [ $tries -ge 100 ]; then
+            echo "server on port $1 did not come up" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+start_http "$HTTP_A"
+start_http "$HTTP_B" --lookup-cache-size 0
+start_http "$HTTP_C" --lookup-cache-size 0 --binary-backend
+# A lookup only succeeds once mdb-lookup-server is up too.
+for port in "$HTTP_A" "$HTTP_B" "$HTTP_C"; do
+    wait_ready "$port" "/mdb-lookup?key=al"
+done
+
+# A spread of lookup keys: common syllables, rarer pairs, and misses.
+KEYS="al be cor da el fi gar ha kaqui lito mora sive hello lunch birthday zzzz"
+mdb_paths() {
+    for key in $KEYS; do
+        printf -- '-p /mdb-lookup?key=%s ' "$key"
+    done
+}
+
+run() {
+    name=$1
+    port=$2
+    shift 2
+    "$BENCH/loadgen" -s "$name" -d "$DURATION" "$@" localhost "$port" |
+        tee -a "${BENCH_OUT:-/dev/null}"
+}
+
+run static-small "$HTTP_A" -c "$CONNS" -p /index.html -p /1k.html -p /16k.html
+run static-large "$HTTP_A" -c "$CONNS" -p /256k.bin -p /4m.bin
+run mdb-cached "$HTTP_A" -c "$CONNS" $(mdb_paths)
+run mdb-uncached-text "$HTTP_B" -c "$CONNS" $(mdb_paths)
+run mdb-uncached-binary "$HTTP_C" -c "$CONNS" $(mdb_paths)
+run mixed-open-loop "$HTTP_C" -c "$CONNS" -r "$RATE" \
+    -p /index.html -p /16k.html -p /256k.bin $(mdb_paths)
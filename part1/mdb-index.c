@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "mdb.h"
+
+/*
+ * Trigram inverted index.
+ *
+ * Every three-character substring of every name and message is hashed into
+ * one of INDEX_BUCKETS buckets, and each bucket keeps a sorted list of the
+ * records containing such a trigram (a posting list). A key can only occur in
+ * records that appear in the posting lists of all of its trigrams, so we
+ * intersect those lists and verify the few survivors with mdb_matches().
+ *
+ * Hash collisions only ever add candidates, never remove them, so the final
+ * verification keeps the results exact. The posting lists are stored back to
+ * back in one array (compressed sparse row layout): bucket b's list is
+ * postings[offsets[b]] through postings[offsets[b + 1] - 1].
+ *
+ * That layout can't take new postings, so records appended after the index
+ * was built (from count on) are scanned instead, until the index is rebuilt.
+ */
+
+#define INDEX_BITS 18
+#define INDEX_BUCKETS (1u << INDEX_BITS)
+#define MAX_KEY_TRIGRAMS 16 // Using a subset of the trigrams is still correct
+#define SCAN_RATIO 2        // Scan if candidates exceed 1/SCAN_RATIO of records
+
+struct MdbIndex {
+    uint32_t *offsets; // INDEX_BUCKETS + 1 entries
+    uint32_t *postings;
+    uint32_t count;    // records indexed
+};
+
+static inline uint32_t trigram_bucket(const char *s)
+{
+    uint32_t t = (uint32_t)(unsigned char)s[0]
+        | (uint32_t)(unsigned char)s[1] << 8
+        | (uint32_t)(unsigned char)s[2] << 16;
+    return (t * 2654435761u) >> (32 - INDEX_BITS);
+}
+
+/*
+ * Call add() for every trigram bucket of record i.
+ *
+ * last[] remembers the most recent record added to each bucket so that a
+ * record is posted at most once per bucket.
+ */
+static void for_each_trigram(const struct Mdb *db, uint32_t i, uint32_t *last,
+        void (*add)(struct MdbIndex *idx, uint32_t b, uint32_t i), struct MdbIndex *idx)
+{
+    const char *fields[2] = { mdb_name(db, i), mdb_msg(db, i) };
+    size_t widths[2] = { MDB_NAME_LEN, MDB_MSG_LEN };
+
+    for (int f = 0; f < 2; f++) {
+        size_t len = strnlen(fields[f], widths[f]);
+        for (size_t pos = 0; pos + 3 <= len; pos++) {
+            uint32_t b = trigram_bucket(fields[f] + pos);
+            if (last[b] != i) {
+                last[b] = i;
+                add(idx, b, i);
+            }
+        }
+    }
+}
+
+static void count_posting(struct MdbIndex *idx, uint32_t b, uint32_t i)
+{
+    idx->offsets[b + 1]++;
+}
+
+static void fill_posting(struct MdbIndex *idx, uint32_t b, uint32_t i)
+{
+    // offsets[b] is used as the fill cursor and restored afterwards.
+    idx->postings[idx->offsets[b]++] = i;
+}
+
+int mdb_build_index(struct Mdb *db)
+{
+    mdb_free_index(db);
+
+    struct MdbIndex *idx = calloc(1, sizeof(*idx));
+    uint32_t *last = malloc(INDEX_BUCKETS * sizeof(*last));
+    if (!idx || !last)
+        goto err;
+
+    idx->offsets = calloc(INDEX_BUCKETS + 1, sizeof(*idx->offsets));
+    if (!idx->offsets)
+        goto err;
+
+    // First pass: count the postings in each bucket.
+    memset(last, 0xff, INDEX_BUCKETS * sizeof(*last));
+    for (uint32_t i = 0; i < db->count; i++)
+        for_each_trigram(db, i, last, &count_posting, idx);
+
+    for (uint32_t b = 0; b < INDEX_BUCKETS; b++)
+        idx->offsets[b + 1] += idx->offsets[b];
+
+    idx->postings = malloc((idx->offsets[INDEX_BUCKETS] + 1) * sizeof(*idx->postings));
+    if (!idx->postings)
+        goto err;
+
+    // Second pass: fill in the postings, which come out sorted by record.
+    memset(last, 0xff, INDEX_BUCKETS * sizeof(*last));
+    for (uint32_t i = 0; i < db->count; i++)
+        for_each_trigram(db, i, last, &fill_posting, idx);
+
+    // Each offsets[b] now points at the end of its list, i.e., the start of
+    // the next one; shift them back into place.
+    memmove(idx->offsets + 1, idx->offsets, INDEX_BUCKETS * sizeof(*idx->offsets));
+    idx->offsets[0] = 0;
+
+    free(last);
+    idx->count = db->count;
+    db->index = idx;
+    return 0;
+
+err:
+    if (idx) {
+        free(idx->offsets);
+        free(idx->postings);
+        free(idx);
+    }
+    free(last);
+    return -1;
+}
+
+uint32_t mdb_unindexed(const struct Mdb *db)
+{
+    return db->index ? db->count - db->index->count : db->count;
+}
+
+void mdb_free_index(struct Mdb *db)
+{
+    if (!db->index)
+        return;
+    free(db->index->offsets);
+    free(db->index->postings);
+    free(db->index);
+    db->index = NULL;
+}
+
+struct posting_list {
+    const uint32_t *ids;
+    uint32_t len;
+};
+
+static int cmp_posting_len(const void *a, const void *b)
+{
+    uint32_t x = ((const struct posting_list *)a)->len;
+    uint32_t y = ((const struct posting_list *)b)->len;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Advance list->ids/len past every entry smaller than id, galloping so that
+ * skipping over long stretches costs O(log n). Returns nonzero if id is then
+ * at the front of the list.
+ */
+static inline int seek_posting(struct posting_list *list, uint32_t id)
+{
+    uint32_t step = 1, lo = 0;
+
+    while (step < list->len && list->ids[step] < id) {
+        lo = step;
+        step *= 2;
+    }
+
+    uint32_t hi = step < list->len ? step : list->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (list->ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    list->ids += lo;
+    list->len -= lo;
+    return list->len > 0 && list->ids[0] == id;
+}
+
+/*
+ * Visit the indexed records that match key.
+ *
+ * Returns negative if a scan would be cheaper, in which case nothing was
+ * visited.
+ */
+static int search_index(const struct Mdb *db, const struct MdbIndex *idx,
+        const char *key, size_t len,
+        void (*visit)(const struct Mdb *db, uint32_t i, void *arg), void *arg)
+{
+    /*
+     * Collect the posting lists of the key's distinct trigram buckets.
+     */
+
+    struct posting_list lists[MAX_KEY_TRIGRAMS];
+    int n = 0;
+
+    for (size_t pos = 0; pos + 3 <= len && n < MAX_KEY_TRIGRAMS; pos++) {
+        uint32_t b = trigram_bucket(key + pos);
+        int dup = 0;
+        for (int j = 0; j < n; j++)
+            if (lists[j].ids == idx->postings + idx->offsets[b])
+                dup = 1;
+        if (dup)
+            continue;
+
+        lists[n].ids = idx->postings + idx->offsets[b];
+        lists[n].len = idx->offsets[b + 1] - idx->offsets[b];
+        if (lists[n].len == 0)
+            return 0; // some trigram occurs nowhere, so neither does key
+        n++;
+    }
+
+    /*
+     * Intersect, driving from the shortest list, and verify the candidates.
+     */
+
+    qsort(lists, n, sizeof(lists[0]), &cmp_posting_len);
+
+    // If even the rarest trigram is common, a straight scan is cheaper than
+    // walking the posting lists.
+    if (lists[0].len > idx->count / SCAN_RATIO)
+        return -1;
+
+    for (uint32_t c = 0; c < lists[0].len; c++) {
+        uint32_t id = lists[0].ids[c];
+        int j;
+
+        for (j = 1; j < n; j++)
+            if (!seek_posting(&lists[j], id))
+                break;
+        if (j < n) {
+            if (lists[j].len == 0)
+                return 0; // exhausted a list; no more candidates possible
+            continue;
+        }
+
+        if (mdb_matches(db, id, key, len))
+            visit(db, id, arg);
+    }
+    return 0;
+}
+
+void mdb_search(const struct Mdb *db, const char *key, size_t len,
+        void (*visit)(const struct Mdb *db, uint32_t i, void *arg), void *arg)
+{
+    const struct MdbIndex *idx = db->index;
+
+    if (!idx || len < 3 || search_index(db, idx, key, len, visit, arg) < 0) {
+        mdb_scan(db, key, len, visit, arg);
+        return;
+    }
+
+    // Records appended since the index was built come after all the indexed
+    // ones, so visiting them last keeps the results in order.
+    for (uint32_t i = idx->count; i < db->count; i++)
+        if (mdb_matches(db, i, key, len))
+            visit(db, i, arg);
+}
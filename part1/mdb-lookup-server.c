@@ -1,23 +1,38 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <linux/limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 
-#include <mylist.h>
 #include "mdb.h"
+#include "mdb-proto.h"
 
-#define MAXPENDING 5          // Maximum outstanding connection requests
+#define MAXPENDING 8          // Default listen() backlog
+#define DEFAULT_WORKERS 16    // Default number of worker threads
+#define DEFAULT_MAX_CLIENTS 1024 // Default limit on open client connections
 #define MAX_LINE_LENGTH 1024  // Maximum line length for request and headers
 #define DISK_IO_BUF_SIZE 4096 // Size of buffer for reading and sending files
+#define CLIENT_BUF_SIZE 4096  // Size of each client's read buffer
+#define CLIENT_READS 16       // Reads per turn with a worker
+#define MAX_EVENTS 64         // Maximum events handled per epoll_wait()
+#define MIN_REINDEX 1024      // Unindexed records we always put up with
+#define DEFAULT_IDLE_TIMEOUT 300 // Seconds a client may sit idle
 
 static void die(const char *message)
 {
@@ -25,53 +40,902 @@ static void die(const char *message)
     exit(1);
 }
 
-int loadmdb(FILE *fp, struct List *dest)
+/*
+ * The in-memory database, shared read-only by all worker threads.
+ *
+ * When the database file changes, the reloader thread builds a complete new
+ * version (index included) off to the side and then swaps db_current to
+ * point at it. Workers take a reference to the current version for each
+ * query, so a query that started on the old version finishes on it; the old
+ * version is freed when its last query drops its reference.
+ *
+ * Added records are appended to the current version in place, past the end
+ * that running queries see: each query works from a copy of the version's
+ * struct Mdb taken when it started, so its record count doesn't change
+ * underneath it. Only when the arrays are full, or too many records have
+ * piled up outside the index, does an add build a new version.
+ */
+struct db_version {
+    struct Mdb db;
+    int refs; // one per query using it, plus one while it is db_current
+};
+
+static struct db_version *db_current;
+static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Held while adding a record or publishing a reload, so that an add can't
+// slip in between reading the file and publishing what we read.
+static pthread_mutex_t db_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static int db_append_fd = -1; // db_path opened for appending, or -1
+static struct stat db_stat;   // db_path as we last loaded or appended to it
+
+static const char *db_path; // database file
+static int use_index = 1;   // build the trigram index for each version
+static int idle_timeout = DEFAULT_IDLE_TIMEOUT; // seconds; 0 waits forever
+
+/*
+ * Take a reference to the current version, and a copy of its struct Mdb to
+ * search.
+ */
+static struct db_version *db_acquire(struct Mdb *snap)
+{
+    pthread_mutex_lock(&db_lock);
+    struct db_version *v = db_current;
+    v->refs++;
+    *snap = v->db;
+    pthread_mutex_unlock(&db_lock);
+    return v;
+}
+
+static void db_release(struct db_version *v)
+{
+    pthread_mutex_lock(&db_lock);
+    int refs = --v->refs;
+    pthread_mutex_unlock(&db_lock);
+
+    // Nobody else can get at v once it's no longer current and unreferenced.
+    if (refs == 0) {
+        mdb_free(&v->db);
+        free(v);
+    }
+}
+
+/*
+ * Make v the version that new queries see.
+ */
+static void db_publish(struct db_version *v)
+{
+    v->refs = 1;
+
+    pthread_mutex_lock(&db_lock);
+    struct db_version *old = db_current;
+    db_current = v;
+    pthread_mutex_unlock(&db_lock);
+
+    if (old)
+        db_release(old);
+}
+
+/*
+ * Returns nonzero if st is db_stat, i.e., the file hasn't changed since we
+ * last loaded or appended to it.
+ */
+static int db_same_file(const struct stat *st)
+{
+    return st->st_dev == db_stat.st_dev && st->st_ino == db_stat.st_ino
+        && st->st_size == db_stat.st_size
+        && st->st_mtim.tv_sec == db_stat.st_mtim.tv_sec
+        && st->st_mtim.tv_nsec == db_stat.st_mtim.tv_nsec;
+}
+
+/*
+ * Add r to the database file and then to the current version.
+ *
+ * Returns the new record's number (from 0); returns negative if failed.
+ */
+static int db_add(const struct MdbRec *r)
+{
+    pthread_mutex_lock(&db_write_lock);
+
+    struct db_version *cur = db_current; // only we and reloads change it
+    struct db_version *v = NULL;
+    uint32_t count = cur->db.count;
+    int i = -1;
+
+    // Once a new version is due, build it before touching the file, so that
+    // running out of memory doesn't leave the file ahead of what we serve.
+    if (count == cur->db.capacity
+            || (use_index && mdb_unindexed(&cur->db) > MIN_REINDEX
+                && mdb_unindexed(&cur->db) > count / 8)) {
+        v = calloc(1, sizeof(*v));
+        if (v == NULL || mdb_clone(&v->db, &cur->db, count ? count * 2 : 1024) < 0)
+            goto out;
+        mdb_append(&v->db, r);
+        if (use_index && mdb_build_index(&v->db) < 0)
+            fprintf(stderr, "mdb_build_index: out of memory; scanning instead\n");
+    }
+
+    if (db_append_fd < 0)
+        db_append_fd = open(db_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (db_append_fd < 0 || write(db_append_fd, r, sizeof(*r)) != sizeof(*r)) {
+        perror(db_path);
+        goto out;
+    }
+
+    // Our own write is no reason to reload, unless the file we wrote to is
+    // no longer the one we loaded.
+    struct stat st;
+    if (fstat(db_append_fd, &st) == 0
+            && st.st_dev == db_stat.st_dev && st.st_ino == db_stat.st_ino)
+        db_stat = st;
+
+    if (v) {
+        i = count;
+        db_publish(v);
+        v = NULL;
+    } else {
+        pthread_mutex_lock(&db_lock);
+        i = mdb_append(&cur->db, r);
+        pthread_mutex_unlock(&db_lock);
+    }
+
+out:
+    if (v) {
+        mdb_free(&v->db);
+        free(v);
+    }
+    pthread_mutex_unlock(&db_write_lock);
+    return i;
+}
+
+/*
+ * Load db_path into a new version, building its index if we use one, and
+ * note in db_stat what we loaded.
+ *
+ * Returns NULL if failed.
+ */
+static struct db_version *db_open(void)
 {
-     /*
-      * read all records into memory
-      */
-  
-     struct MdbRec r;
-     struct Node *node = NULL;
-     int count = 0;
- 
-     while (fread(&r, sizeof(r), 1, fp) == 1) {
- 
-         // allocate memory for a new record and copy into it the one
-         // that was just read from the database.
-         struct MdbRec *rec = (struct MdbRec *)malloc(sizeof(r));
-         if (!rec)
-             return -1;
- 
-         memcpy(rec, &r, sizeof(r));
- 
-         // add the record to the linked list.
-         node = addAfter(dest, node, rec);
-         if (node == NULL)
-             return -1;
- 
-         count++;
-     }
- 
-     // see if fread() produced error
-     if (ferror(fp))
-         return -1;
- 
-     return count;
- }
- 
- void freemdb(struct List *list)
- {
-     // free all the records
-     traverseList(list, &free);
-     removeAllNodes(list);
- }
-
-static void sigchld_handler(int sig)
+    struct db_version *v = calloc(1, sizeof(*v));
+    if (v == NULL)
+        return NULL;
+
+    FILE *fp = fopen(db_path, "rb");
+    if (fp == NULL) {
+        perror(db_path);
+        free(v);
+        return NULL;
+    }
+
+    struct stat st;
+    int n = fstat(fileno(fp), &st) < 0 ? -1 : mdb_load(&v->db, fp);
+    fclose(fp);
+    if (n < 0) {
+        fprintf(stderr, "mdb_load: %s: failed\n", db_path);
+        free(v);
+        return NULL;
+    }
+
+    // The index is an optimization; without it we just scan every record.
+    if (use_index && mdb_build_index(&v->db) < 0)
+        fprintf(stderr, "mdb_build_index: out of memory; scanning instead\n");
+
+    db_stat = st;
+    return v;
+}
+
+/*
+ * Growable output buffer for answers.
+ */
+struct out_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+static unsigned char *out_reserve(struct out_buf *out, size_t n)
 {
-    // Keep reaping dead children until there aren't any to reap.
-    while (waitpid(-1, NULL, WNOHANG) > 0)
-        ;
+    if (out->len + n > out->cap) {
+        size_t cap = out->cap ? out->cap : CLIENT_BUF_SIZE;
+        while (cap < out->len + n)
+            cap *= 2;
+        unsigned char *data = realloc(out->data, cap);
+        if (data == NULL)
+            return NULL;
+        out->data = data;
+        out->cap = cap;
+    }
+    return out->data + out->len;
+}
+
+/*
+ * An answer being appended to out, a record at a time, by put_rec() for
+ * binary clients or print_rec() for text ones.
+ */
+struct answer {
+    struct out_buf *out;
+    uint32_t count;
+    int failed; // out of memory
+};
+
+static void put_fields(struct answer *ans, uint32_t i, const char *name,
+        const char *msg)
+{
+    size_t name_len = strnlen(name, MDB_NAME_LEN);
+    size_t msg_len = strnlen(msg, MDB_MSG_LEN);
+
+    unsigned char *p = out_reserve(ans->out, MDB_REC_HDR_LEN + name_len + msg_len);
+    if (p == NULL) {
+        ans->failed = 1;
+        return;
+    }
+
+    mdb_put32(p, i + 1);
+    p[4] = name_len;
+    p[5] = msg_len;
+    memcpy(p + MDB_REC_HDR_LEN, name, name_len);
+    memcpy(p + MDB_REC_HDR_LEN + name_len, msg, msg_len);
+    ans->out->len += MDB_REC_HDR_LEN + name_len + msg_len;
+    ans->count++;
+}
+
+static void put_rec(const struct Mdb *db, uint32_t i, void *arg)
+{
+    put_fields(arg, i, mdb_name(db, i), mdb_msg(db, i));
+}
+
+/*
+ * Append one matching record in the format mdb-lookup clients expect.
+ * Record numbers start at 1.
+ */
+static void print_rec(const struct Mdb *db, uint32_t i, void *arg)
+{
+    struct answer *ans = arg;
+    size_t max = 32 + MDB_NAME_LEN + MDB_MSG_LEN;
+
+    unsigned char *p = out_reserve(ans->out, max);
+    if (p == NULL) {
+        ans->failed = 1;
+        return;
+    }
+
+    ans->out->len += snprintf((char *)p, max, "%4d: {%.*s} said {%.*s}\n", (int)i + 1,
+            MDB_NAME_LEN, mdb_name(db, i), MDB_MSG_LEN, mdb_msg(db, i));
+    ans->count++;
+}
+
+/*
+ * Returns nonzero if the len bytes at s hold a control character. A record
+ * with a line break in it would break the text protocol's answers.
+ */
+static int has_control(const unsigned char *s, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        if (s[i] < 0x20 || s[i] == 0x7f)
+            return 1;
+    return 0;
+}
+
+/*
+ * Handle the add request at req (see mdb-proto.h), of which we have len
+ * bytes, and append its answer to out. A record with control characters is
+ * refused, i.e., answered with no record.
+ *
+ * Returns the length of the request; returns 0 if it isn't all here yet, or
+ * (size_t)-1 if we ran out of memory.
+ */
+static size_t add_request(struct out_buf *out, uint32_t id, const unsigned char *req,
+        size_t len)
+{
+    if (len < MDB_REQ_ADD_HDR_LEN)
+        return 0;
+    size_t name_len = req[6];
+    size_t msg_len = req[7];
+    if (len < MDB_REQ_ADD_HDR_LEN + name_len + msg_len)
+        return 0;
+
+    // Cut the fields short, keeping room for their terminators.
+    struct MdbRec r;
+    memset(&r, 0, sizeof(r));
+    memcpy(r.name, req + MDB_REQ_ADD_HDR_LEN,
+            name_len < MDB_NAME_LEN - 1 ? name_len : MDB_NAME_LEN - 1);
+    memcpy(r.msg, req + MDB_REQ_ADD_HDR_LEN + name_len,
+            msg_len < MDB_MSG_LEN - 1 ? msg_len : MDB_MSG_LEN - 1);
+
+    size_t hdr = out->len;
+    if (out_reserve(out, MDB_RESP_HDR_LEN) == NULL)
+        return -1;
+    out->len += MDB_RESP_HDR_LEN;
+
+    // Answer with the record as stored, read back the way a search would.
+    struct answer ans = { out, 0, 0 };
+    int i = -1;
+    if (!has_control(req + MDB_REQ_ADD_HDR_LEN, name_len + msg_len))
+        i = db_add(&r);
+    if (i >= 0)
+        put_fields(&ans, i, r.name, r.msg);
+    if (ans.failed)
+        return -1;
+
+    mdb_put32(out->data + hdr, id);
+    mdb_put32(out->data + hdr + 4, ans.count);
+    return MDB_REQ_ADD_HDR_LEN + name_len + msg_len;
+}
+
+/*
+ * A client connection.
+ *
+ * Clients are multiplexed over the worker pool: the main thread waits on
+ * every connection with epoll and hands one that has something to read to a
+ * worker, which answers the requests that have come in and then gives the
+ * connection back. A worker is thus busy only while there is something to
+ * answer, and any number of persistent clients, idle most of the time, share
+ * a few workers. Each connection is registered with EPOLLONESHOT, so no two
+ * workers ever serve it at once and its answers go out in order.
+ */
+enum client_proto { PROTO_UNKNOWN, PROTO_TEXT, PROTO_BINARY };
+
+struct client {
+    int fd;
+    char ip[INET_ADDRSTRLEN];
+    enum client_proto proto;
+    int greeted;  // binary: the magic has been read
+    int skipping; // text: discarding the rest of an overlong line
+    int eof;      // the client has sent all it's going to
+    unsigned char in[CLIENT_BUF_SIZE];
+    size_t in_len;
+    struct out_buf out;
+    size_t out_sent;  // bytes of out written so far
+
+    // Guarded by clients.lock.
+    int busy;                   // with a worker, or waiting for one
+    int writing;                // waiting for room to send out
+    long long last_active;      // ms, since when it's been idle or writing
+    struct client *prev, *next; // in clients.all
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    struct client **ready; // ring of max_clients clients waiting for a worker
+    int head;
+    int len;
+    struct client *all;    // every open connection
+    int count;
+} clients = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+};
+
+static int max_clients = DEFAULT_MAX_CLIENTS;
+static int ep_fd;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Serve the binary protocol requests (see mdb-proto.h) read into c->in,
+ * appending their answers to c->out. A request not all here yet stays in
+ * c->in for next time.
+ *
+ * Returns negative if the client broke the protocol or we ran out of memory.
+ */
+static int serve_binary(struct client *c)
+{
+    struct db_version *v = NULL; // version answering this batch
+    struct Mdb snap;             // v's records as of the batch's start
+    size_t pos = 0;
+    int err = 0;
+
+    if (!c->greeted) {
+        if (c->in_len < MDB_PROTO_MAGIC_LEN)
+            return 0;
+        if (memcmp(c->in, MDB_PROTO_MAGIC, MDB_PROTO_MAGIC_LEN) != 0)
+            return -1;
+        pos = MDB_PROTO_MAGIC_LEN;
+        c->greeted = 1;
+
+        // Greet the client back.
+        unsigned char *p = out_reserve(&c->out, MDB_PROTO_MAGIC_LEN);
+        if (p == NULL)
+            return -1;
+        memcpy(p, MDB_PROTO_MAGIC, MDB_PROTO_MAGIC_LEN);
+        c->out.len += MDB_PROTO_MAGIC_LEN;
+    }
+
+    while (c->in_len - pos >= MDB_REQ_HDR_LEN) {
+        unsigned char *req = c->in + pos;
+        uint32_t id = mdb_get32(req);
+        size_t key_len = mdb_get16(req + 4);
+
+        if (key_len == MDB_ADD_REQ) {
+            size_t len = add_request(&c->out, id, req, c->in_len - pos);
+            if (len == 0)
+                break; // incomplete
+            if (len == (size_t)-1) {
+                err = -1;
+                break;
+            }
+            pos += len;
+
+            // Searches after the add must see it.
+            if (v) {
+                db_release(v);
+                v = NULL;
+            }
+            continue;
+        }
+
+        if (key_len > MDB_MAX_KEY_LEN) {
+            err = -1;
+            break;
+        }
+        if (c->in_len - pos < MDB_REQ_HDR_LEN + key_len)
+            break;
+
+        // Searches read together are answered from the same version.
+        if (v == NULL)
+            v = db_acquire(&snap);
+
+        // Leave room for the header; we know the count only at the end.
+        size_t hdr = c->out.len;
+        if (out_reserve(&c->out, MDB_RESP_HDR_LEN) == NULL) {
+            err = -1;
+            break;
+        }
+        c->out.len += MDB_RESP_HDR_LEN;
+
+        struct answer ans = { &c->out, 0, 0 };
+        mdb_search(&snap, (const char *)req + MDB_REQ_HDR_LEN, key_len, &put_rec, &ans);
+        if (ans.failed) {
+            err = -1;
+            break;
+        }
+
+        mdb_put32(c->out.data + hdr, id);
+        mdb_put32(c->out.data + hdr + 4, ans.count);
+
+        pos += MDB_REQ_HDR_LEN + key_len;
+    }
+
+    if (v)
+        db_release(v);
+    c->in_len -= pos;
+    memmove(c->in, c->in + pos, c->in_len);
+    return err;
+}
+
+/*
+ * Serve the complete lines read into c->in, one lookup key per line,
+ * appending the matching records and an empty line for each to c->out.
+ *
+ * A line longer than MAX_LINE_LENGTH - 1 bytes is searched for what fits,
+ * and the rest of it, up to its newline, is discarded.
+ *
+ * Returns negative if we ran out of memory.
+ */
+static int serve_text(struct client *c)
+{
+    struct db_version *v = NULL;
+    struct Mdb snap;
+    size_t pos = 0;
+    int err = 0;
+
+    while (pos < c->in_len) {
+        const char *line = (const char *)c->in + pos;
+        size_t avail = c->in_len - pos;
+        const char *nl = memchr(line, '\n', avail);
+        size_t line_len = nl ? (size_t)(nl - line) + 1 : avail;
+
+        if (c->skipping) {
+            c->skipping = nl == NULL;
+            pos += line_len;
+            continue;
+        }
+
+        if (nl == NULL) {
+            if (avail < MAX_LINE_LENGTH - 1)
+                break; // incomplete
+            line_len = MAX_LINE_LENGTH - 1;
+            c->skipping = 1;
+        }
+
+        // the key is the line up to its newline or carriage return.
+        size_t len = 0;
+        while (len < line_len && line[len] != '\r' && line[len] != '\n' && line[len] != '\0')
+            len++;
+
+        if (v == NULL)
+            v = db_acquire(&snap);
+
+        struct answer ans = { &c->out, 0, 0 };
+        mdb_search(&snap, line, len, &print_rec, &ans);
+
+        // an empty line separates answers
+        if (ans.failed || out_reserve(&c->out, 1) == NULL) {
+            err = -1;
+            break;
+        }
+        c->out.data[c->out.len++] = '\n';
+
+        pos += line_len;
+    }
+
+    if (v)
+        db_release(v);
+    c->in_len -= pos;
+    memmove(c->in, c->in + pos, c->in_len);
+    return err;
+}
+
+/*
+ * Send as much of c->out as the socket will take. What's left goes out once
+ * the socket has room again; the worker doesn't wait for it.
+ *
+ * Returns negative if the write failed.
+ */
+static int client_flush(struct client *c)
+{
+    while (c->out_sent < c->out.len) {
+        ssize_t n = write(c->fd, c->out.data + c->out_sent, c->out.len - c->out_sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0)
+            return -1;
+        c->out_sent += n;
+    }
+    c->out.len = c->out_sent = 0;
+
+    // Don't let a client that once asked for a lot hold on to the memory.
+    if (c->out.cap > CLIENT_BUF_SIZE) {
+        free(c->out.data);
+        c->out.data = NULL;
+        c->out.cap = 0;
+    }
+    return 0;
+}
+
+/*
+ * Read and answer what client c has sent, up to CLIENT_READS reads so that
+ * one busy client can't keep its worker from the others.
+ *
+ * We answer every complete request we have read before writing, so a client
+ * that pipelines gets its answers in as few write()s as possible. Until the
+ * answers are all out, we read nothing more from the client, so one that
+ * doesn't take them can't make us hold more.
+ *
+ * Returns negative once the connection is done with.
+ */
+static int serve_client(struct client *c)
+{
+    if (client_flush(c) < 0)
+        return -1;
+    if (c->eof && c->out.len == 0)
+        return -1;
+
+    for (int i = 0; i < CLIENT_READS && c->out.len == 0; i++) {
+        ssize_t n = read(c->fd, c->in + c->in_len, CLIENT_BUF_SIZE - c->in_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+
+        if (n == 0) {
+            // Answer a last line sent without its newline, and close once
+            // the answers are out.
+            if (c->proto == PROTO_TEXT && c->in_len > 0 && !c->skipping) {
+                c->in[c->in_len++] = '\n';
+                if (serve_text(c) < 0 || client_flush(c) < 0)
+                    return -1;
+            }
+            c->eof = 1;
+            return c->out.len > 0 ? 0 : -1;
+        }
+        c->in_len += n;
+
+        // Binary clients start with a NUL; see mdb-proto.h.
+        if (c->proto == PROTO_UNKNOWN)
+            c->proto = c->in[0] == MDB_PROTO_MAGIC[0] ? PROTO_BINARY : PROTO_TEXT;
+
+        int err = c->proto == PROTO_BINARY ? serve_binary(c) : serve_text(c);
+        if (err < 0 || client_flush(c) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Called with clients.lock held.
+ */
+static void client_unlink(struct client *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        clients.all = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    clients.count--;
+}
+
+/*
+ * Close and free a client no longer on clients.all.
+ */
+static void client_free(struct client *c)
+{
+    //Print connection terminated message
+    fprintf(stderr, "Connection terminated: %s\n", c->ip);
+
+    close(c->fd);
+    free(c->out.data);
+    free(c);
+}
+
+/*
+ * Wait for more from client c, or for room to send it the rest of its
+ * answers; called with clients.lock held.
+ *
+ * Returns negative if c can't be waited on, and has to be closed.
+ */
+static int client_wait(struct client *c)
+{
+    struct epoll_event ev;
+    ev.data.ptr = c;
+
+    // A client gets idle_timeout seconds to take all of its answers, however
+    // slowly it takes them, so the clock doesn't restart while writing.
+    if (c->out.len > 0) {
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        if (!c->writing)
+            c->last_active = now_ms();
+        c->writing = 1;
+    } else {
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        c->last_active = now_ms();
+        c->writing = 0;
+    }
+
+    c->busy = 0;
+    return epoll_ctl(ep_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/*
+ * Queue client c, which has something for us to read or room for its
+ * answers, for a worker.
+ */
+static void client_ready(struct client *c)
+{
+    pthread_mutex_lock(&clients.lock);
+
+    // A client is queued at most once, so there is always room.
+    c->busy = 1;
+    clients.ready[(clients.head + clients.len) % max_clients] = c;
+    clients.len++;
+
+    pthread_cond_signal(&clients.not_empty);
+    pthread_mutex_unlock(&clients.lock);
+}
+
+static void *worker_main(void *arg)
+{
+    for (;;) {
+        pthread_mutex_lock(&clients.lock);
+        while (clients.len == 0)
+            pthread_cond_wait(&clients.not_empty, &clients.lock);
+        struct client *c = clients.ready[clients.head];
+        clients.head = (clients.head + 1) % max_clients;
+        clients.len--;
+        pthread_mutex_unlock(&clients.lock);
+
+        int done = serve_client(c) < 0;
+
+        // Give the connection back, unless it's finished. We do it holding
+        // the lock so that the idle sweep can't free it along the way.
+        pthread_mutex_lock(&clients.lock);
+        if (!done && client_wait(c) < 0) {
+            perror("epoll_ctl");
+            done = 1;
+        }
+        if (done)
+            client_unlink(c);
+        pthread_mutex_unlock(&clients.lock);
+
+        if (done)
+            client_free(c);
+    }
+
+    return NULL;
+}
+
+/*
+ * Accept every connection waiting on serv_fd.
+ */
+static void accept_clients(int serv_fd)
+{
+    for (;;) {
+        struct sockaddr_in clnt_addr;
+        socklen_t clnt_len = sizeof(clnt_addr);
+
+        int fd = accept4(serv_fd, (struct sockaddr *)&clnt_addr, &clnt_len,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        char clnt_ip[INET_ADDRSTRLEN];
+        if (inet_ntop(AF_INET, &clnt_addr.sin_addr, clnt_ip, sizeof(clnt_ip)) == NULL)
+            strcpy(clnt_ip, "?");
+
+        // Only this thread adds clients, so the count can't grow behind our
+        // back. At the limit, closing at once tells the client to go
+        // elsewhere or come back later, which beats leaving it to wait.
+        pthread_mutex_lock(&clients.lock);
+        int full = clients.count >= max_clients;
+        pthread_mutex_unlock(&clients.lock);
+
+        struct client *c = full ? NULL : calloc(1, sizeof(*c));
+        if (c == NULL) {
+            if (!full)
+                perror("calloc");
+            fprintf(stderr, "Connection turned away: %s\n", clnt_ip);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        strcpy(c->ip, clnt_ip);
+
+        //Print connection started message
+        fprintf(stderr, "Connection started: %s\n", clnt_ip);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = c;
+
+        pthread_mutex_lock(&clients.lock);
+        c->last_active = now_ms();
+        c->next = clients.all;
+        if (clients.all)
+            clients.all->prev = c;
+        clients.all = c;
+        clients.count++;
+        int err = epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev);
+        if (err < 0)
+            client_unlink(c);
+        pthread_mutex_unlock(&clients.lock);
+
+        if (err < 0) {
+            perror("epoll_ctl");
+            client_free(c);
+        }
+    }
+}
+
+/*
+ * Close the connections that have sent nothing, or not taken all of their
+ * answers, for idle_timeout seconds, so that clients that have gone away
+ * don't count against max_clients forever.
+ */
+static void sweep_idle(long long now)
+{
+    struct client *idle = NULL;
+
+    pthread_mutex_lock(&clients.lock);
+    for (struct client *c = clients.all, *next; c; c = next) {
+        next = c->next;
+        if (!c->busy && now - c->last_active >= idle_timeout * 1000LL) {
+            client_unlink(c);
+            c->next = idle;
+            idle = c;
+        }
+    }
+    pthread_mutex_unlock(&clients.lock);
+
+    while (idle) {
+        struct client *next = idle->next;
+        client_free(idle);
+        idle = next;
+    }
+}
+
+/*
+ * Reload the database whenever its file is replaced or rewritten, or when we
+ * get SIGHUP.
+ *
+ * We watch the directory rather than the file itself, so that we also notice
+ * a new file renamed over the old one (the safe way to update it). If the new
+ * file can't be loaded, we keep serving the version we have.
+ */
+static void *reloader_main(void *arg)
+{
+    int sig_fd = *(int *)arg;
+
+    char dir_buf[PATH_MAX], base_buf[PATH_MAX];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", db_path);
+    snprintf(base_buf, sizeof(base_buf), "%s", db_path);
+    const char *dir = dirname(dir_buf);
+    const char *base = basename(base_buf);
+
+    // Without inotify we still reload on SIGHUP.
+    int in_fd = inotify_init1(IN_CLOEXEC);
+    if (in_fd < 0)
+        perror("inotify_init1");
+    else if (inotify_add_watch(in_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        perror("inotify_add_watch");
+
+    struct pollfd fds[2] = {
+        { .fd = sig_fd, .events = POLLIN },
+        { .fd = in_fd, .events = POLLIN }, // ignored by poll() if negative
+    };
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+
+        int reload = 0, forced = 0;
+
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if (read(sig_fd, &si, sizeof(si)) == sizeof(si))
+                reload = forced = 1;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            ssize_t n = read(in_fd, buf, sizeof(buf));
+            for (char *p = buf; n > 0 && p < buf + n; ) {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(*ev) + ev->len;
+                if ((ev->mask & IN_Q_OVERFLOW) || (ev->len && strcmp(ev->name, base) == 0))
+                    reload = 1;
+            }
+        }
+
+        if (!reload)
+            continue;
+
+        pthread_mutex_lock(&db_write_lock);
+
+        // Our own appends, and closing db_append_fd below, raise events too;
+        // reload only if the file is not what we already serve.
+        struct stat st;
+        if (!forced && stat(db_path, &st) == 0 && db_same_file(&st)) {
+            pthread_mutex_unlock(&db_write_lock);
+            continue;
+        }
+
+        struct db_version *v = db_open();
+        if (v == NULL) {
+            fprintf(stderr, "Reload of %s failed; still serving the old version\n", db_path);
+        } else {
+            fprintf(stderr, "Reloaded %s: %u records\n", db_path, (unsigned)v->db.count);
+            db_publish(v);
+
+            // The file may have been replaced; append to the new one.
+            if (db_append_fd >= 0)
+                close(db_append_fd);
+            db_append_fd = -1;
+        }
+
+        pthread_mutex_unlock(&db_write_lock);
+    }
+
+    return NULL;
 }
 
 int main(int argc, char *argv[])
@@ -91,25 +955,86 @@ int main(int argc, char *argv[])
     if (sigaction(SIGPIPE, &sa, NULL))
         die("sigaction(SIGPIPE)");
 
-    // Install a handler for the SIGCHLD signal so that we can reap children
-    // who have finished processing their requests.
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    sa.sa_handler = &sigchld_handler;
-    if (sigaction(SIGCHLD, &sa, NULL))
-        die("sigaction(SIGCHLD)");
+    // SIGHUP asks for a reload. Block it in every thread (they inherit our
+    // mask) so that the reloader can read it from a signalfd instead.
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    if (pthread_sigmask(SIG_BLOCK, &hup, NULL))
+        die("pthread_sigmask");
+
+    int sig_fd = signalfd(-1, &hup, SFD_CLOEXEC);
+    if (sig_fd < 0)
+        die("signalfd");
 
     /*
      * Parse arguments.
      */
 
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s <server-port> <database>\n", argv[0]);
+    int workers = DEFAULT_WORKERS;
+    int backlog = MAXPENDING;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "nw:c:t:b:")) != -1) {
+        switch (opt) {
+        case 'n': // don't build the trigram index; always scan
+            use_index = 0;
+            break;
+        case 'w': // number of worker threads, i.e., requests served at once
+            workers = atoi(optarg);
+            if (workers <= 0)
+                goto usage;
+            break;
+        case 'c': // open connections; more are turned away
+            max_clients = atoi(optarg);
+            if (max_clients <= 0)
+                goto usage;
+            break;
+        case 'b': // connections the kernel queues for us to accept
+            backlog = atoi(optarg);
+            if (backlog <= 0)
+                goto usage;
+            break;
+        case 't': // seconds a client may sit idle; 0 waits forever
+            idle_timeout = atoi(optarg);
+            if (idle_timeout < 0)
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (argc - optind != 2) {
+usage:
+        fprintf(stderr, "usage: %s [-n] [-w <workers>] [-c <max-conns>] [-b <backlog>] [-t <idle-secs>] "
+                "<server-port> <database>\n", argv[0]);
         exit(1);
     }
 
-    char *serv_port = argv[1];
-    char *database = argv[2];
+    char *serv_port = argv[optind];
+    db_path = argv[optind + 1];
+
+    /*
+     * Load the database once, before we start accept()ing connections.
+     *
+     * All worker threads share this one copy and only ever read it, so
+     * neither connection setup time nor memory grows with each client.
+     * Later versions are loaded by the reloader thread.
+     */
+
+    struct db_version *first = db_open();
+    if (first == NULL)
+        exit(1);
+    db_publish(first);
+
+    pthread_t reloader;
+    int err = pthread_create(&reloader, NULL, &reloader_main, &sig_fd);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(1);
+    }
+    pthread_detach(reloader);
 
     /*
      * Construct server socket to listen on serv_port.
@@ -133,150 +1058,87 @@ int main(int argc, char *argv[])
     if (serv_fd < 0)
         die("socket");
 
+    // Let a restarted server bind while old connections sit in TIME_WAIT.
+    int one = 1;
+    if (setsockopt(serv_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+        die("setsockopt(SO_REUSEADDR)");
+
     if (bind(serv_fd, info->ai_addr, info->ai_addrlen) < 0)
         die("bind");
 
-    if (listen(serv_fd, 8) < 0)
+    if (listen(serv_fd, backlog) < 0)
         die("listen");
 
     freeaddrinfo(info);
 
+    // Connections are accepted as they come, from the event loop below.
+    if (fcntl(serv_fd, F_SETFL, O_NONBLOCK) < 0)
+        die("fcntl");
+
+    // Every connection is a file descriptor; allow as many as we're permitted.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    ep_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ep_fd < 0)
+        die("epoll_create1");
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // the listening socket
+    if (epoll_ctl(ep_fd, EPOLL_CTL_ADD, serv_fd, &ev) < 0)
+        die("epoll_ctl");
+
     /*
-     * Server accept() loop.
+     * Start the worker pool.
      */
 
-    for (;;) {
-        // We only need sockaddr_in since we only accept IPv4 peers.
-        struct sockaddr_in clnt_addr;
-        socklen_t clnt_len = sizeof(clnt_addr);
+    clients.ready = malloc(max_clients * sizeof(*clients.ready));
+    if (clients.ready == NULL)
+        die("malloc");
 
-        int clnt_fd = accept(serv_fd, (struct sockaddr *)&clnt_addr, &clnt_len);
-        if (clnt_fd < 0)
-            die("accept");
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, &worker_main, NULL);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
 
-        pid_t pid = fork();
-        if (pid < 0)
-            die("fork");
+    /*
+     * Server event loop: accept connections, hand clients with something
+     * to read to the workers, and drop those that have gone quiet.
+     */
 
-        if (pid > 0) {
-            /*
-             * Parent process:
-             *
-             * Close client socket and continue accept()ing connections.
-             */
+    long long last_sweep = now_ms();
 
-            close(clnt_fd);
+    for (;;) {
+        struct epoll_event events[MAX_EVENTS];
 
-            continue;
+        int n = epoll_wait(ep_fd, events, MAX_EVENTS, idle_timeout > 0 ? 1000 : -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait");
         }
 
-        /*
-         * Child process:
-         *
-         * Close server socket, handle the request, and exit.
-         */
-        
-        
-        close(serv_fd);
-
-        char clnt_ip[INET_ADDRSTRLEN];
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_clients(serv_fd);
+            else
+                client_ready(events[i].data.ptr);
+        }
 
-        if (inet_ntop(AF_INET, &clnt_addr.sin_addr, clnt_ip, sizeof(clnt_ip))
-            == NULL)
-            die("inet_ntop");
-        
-        //Print connection started message
-        fprintf(stderr, "Connection started: %s\n", clnt_ip);
-        
-        //FILE* for reading
-        FILE *fpr = fdopen(clnt_fd, "r");
-        if(fpr == NULL)
-            die("fdopen");
-
-        //FILE* for writing
-        FILE *fpw = fdopen(clnt_fd, "w");
-        if(fpw == NULL)
-            die("fdopen");
-
-        //FILE* to store database
-        FILE *fp = fopen(database,"rb");
-        if(fp == NULL)
-            die("fopen");
-
-        //Set fpw to line-buffering so that lines are flushed immediately
-        setlinebuf(fpw);
-
-        //mdb-lookup code
-        struct List list;
-        initList(&list);
-
-        int loaded = loadmdb(fp, &list);
-        if (loaded < 0)
-            die("loadmdb");
-
-        fclose(fp);
-
-        /*
-         * lookup loop
-         */
-
-        char line[1024];
-        char key[6];
-
-
-        while (fgets(line, sizeof(line), fpr) != NULL) {
-
-            /*
-             * clean up user input
-             */
-
-            // must null-terminate the string manually after strncpy().
-            strncpy(key, line, sizeof(key) - 1);
-            key[sizeof(key) - 1] = '\0';
-
-            // if newline or carriage return is within the first KeyMax characters, remove it.
-            int last = strlen(key) - 1;
-            if (key[last] == '\n'|| key[last] == '\r'){
-                if(key[last-1] == '\r'){
-                    key[last-1] = '\0';
-                }
-                else{
-                    key[last] = '\0';
-                }
-            }
-            
-            // user might have typed more than sizeof(line) - 1 characters in line;
-            // continue fgets()ing until we encounter a newline.
-            while (line[strlen(line) - 1] != '\n' && fgets(line, sizeof(line), fpr))
-                ;
-
-            /*
-             * search with key
-             */
-
-            // traverse the list, printing out the matching records
-            struct Node *node = list.head;
-            int recNo = 1;
-            while (node) {
-                struct MdbRec *rec = (struct MdbRec *)node->data;
-
-                if (strstr(rec->name, key) || strstr(rec->msg, key))
-                    fprintf(fpw, "%4d: {%s} said {%s}\n", recNo, rec->name, rec->msg);
-
-                node = node->next;
-                recNo++;
-            }
-            //print new line to separate requests
-            fprintf(fpw, "\n");
+        long long now = now_ms();
+        if (idle_timeout > 0 && now - last_sweep >= 1000) {
+            sweep_idle(now);
+            last_sweep = now;
         }
-        freemdb(&list);
-
-        //Send message that connection terminated
-        fprintf(stderr, "Connection terminated: %s\n", clnt_ip);
-        
-        fclose(fpr);
-        fclose(fpw);
-        exit(0);
     }
 
     /*
@@ -0,0 +1,78 @@
+#ifndef __MDB_PROTO_H__
+#define __MDB_PROTO_H__
+
+#include <stdint.h>
+
+/*
+ * Binary protocol spoken by mdb-lookup-server next to the text one.
+ *
+ * A client picks it by sending the MDB_PROTO_MAGIC bytes first (a text
+ * client never starts with a NUL), and the server answers with the same
+ * bytes once it has taken the connection on; a client can wait for them to
+ * know that its requests will be served. After that, every request is
+ *
+ *     uint32 id, uint16 key_len, key_len bytes of key
+ *
+ * and the server answers each request, in the order they were sent, with
+ *
+ *     uint32 id, uint32 count,
+ *     then count records of: uint32 recno, uint8 name_len, uint8 msg_len,
+ *                            name_len bytes of name, msg_len bytes of msg
+ *
+ * All integers are big-endian. id is whatever the client chose; it's echoed
+ * back so that answers can be matched to requests. A key matches exactly
+ * the records it does in the text protocol, and record numbers start at 1.
+ * Clients may send any number of requests without waiting for answers.
+ *
+ * A request with key_len over MDB_MAX_KEY_LEN is a protocol error; the
+ * server closes the connection. (No record field is anywhere near that
+ * long, so such a key could never match anyway.)
+ *
+ * The one exception is key_len MDB_ADD_REQ, which asks the server to add a
+ * record instead of searching:
+ *
+ *     uint32 id, uint16 MDB_ADD_REQ, uint8 name_len, uint8 msg_len,
+ *     name_len bytes of name, msg_len bytes of msg
+ *
+ * Fields too long for a record are cut short; fields with control characters
+ * are refused. The answer has the same form as a search's: count 1 with the
+ * record as stored, or count 0 if the server could not store it. Requests sent after an add are answered with the
+ * record in place.
+ */
+
+#define MDB_PROTO_MAGIC "\0MDB"
+#define MDB_PROTO_MAGIC_LEN 4
+
+#define MDB_MAX_KEY_LEN 255
+#define MDB_ADD_REQ 0xffff // key_len of an add request
+
+#define MDB_REQ_HDR_LEN 6     // id, key_len
+#define MDB_REQ_ADD_HDR_LEN 8 // id, MDB_ADD_REQ, name_len, msg_len
+#define MDB_RESP_HDR_LEN 8    // id, count
+#define MDB_REC_HDR_LEN 6     // recno, name_len, msg_len
+
+static inline void mdb_put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void mdb_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline uint16_t mdb_get16(const unsigned char *p)
+{
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t mdb_get32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+#endif
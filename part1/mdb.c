@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "mdb.h"
+
+// Bytes the vectorized matcher loads from a field of the given width.
+#define VEC_SPAN(width) ((width) + 31)
+
+static int mdb_grow(struct Mdb *db)
+{
+    uint32_t capacity = db->capacity ? db->capacity * 2 : 1024;
+
+    char *names = realloc(db->names, (size_t)capacity * MDB_NAME_LEN);
+    if (!names)
+        return -1;
+    db->names = names;
+
+    char *msgs = realloc(db->msgs, (size_t)capacity * MDB_MSG_LEN);
+    if (!msgs)
+        return -1;
+    db->msgs = msgs;
+
+    db->capacity = capacity;
+    return 0;
+}
+
+int mdb_load(struct Mdb *db, FILE *fp)
+{
+    struct MdbRec r;
+
+    memset(db, 0, sizeof(*db));
+
+    while (fread(&r, sizeof(r), 1, fp) == 1) {
+        if (db->count == db->capacity && mdb_grow(db) < 0)
+            goto err;
+
+        memcpy(db->names + (size_t)db->count * MDB_NAME_LEN, r.name, MDB_NAME_LEN);
+        memcpy(db->msgs + (size_t)db->count * MDB_MSG_LEN, r.msg, MDB_MSG_LEN);
+        db->count++;
+    }
+
+    // see if fread() produced error
+    if (ferror(fp))
+        goto err;
+
+    // Even an empty database gets its arrays, so that mdb_append() and
+    // mdb_clone() need not special-case it.
+    if (db->capacity == 0 && mdb_grow(db) < 0)
+        goto err;
+
+    return db->count;
+
+err:
+    mdb_free(db);
+    return -1;
+}
+
+void mdb_free(struct Mdb *db)
+{
+    mdb_free_index(db);
+    free(db->names);
+    free(db->msgs);
+    memset(db, 0, sizeof(*db));
+}
+
+int mdb_append(struct Mdb *db, const struct MdbRec *r)
+{
+    if (db->count == db->capacity)
+        return -1;
+
+    uint32_t i = db->count;
+    memcpy(db->names + (size_t)i * MDB_NAME_LEN, r->name, MDB_NAME_LEN);
+    memcpy(db->msgs + (size_t)i * MDB_MSG_LEN, r->msg, MDB_MSG_LEN);
+
+    db->count++;
+    return i;
+}
+
+int mdb_clone(struct Mdb *dst, const struct Mdb *src, uint32_t capacity)
+{
+    memset(dst, 0, sizeof(*dst));
+    if (capacity < src->count)
+        capacity = src->count;
+
+    dst->names = malloc((size_t)capacity * MDB_NAME_LEN);
+    dst->msgs = malloc((size_t)capacity * MDB_MSG_LEN);
+    if (!dst->names || !dst->msgs) {
+        mdb_free(dst);
+        return -1;
+    }
+
+    memcpy(dst->names, src->names, (size_t)src->count * MDB_NAME_LEN);
+    memcpy(dst->msgs, src->msgs, (size_t)src->count * MDB_MSG_LEN);
+    dst->count = src->count;
+    dst->capacity = capacity;
+    return 0;
+}
+
+/*
+ * Substring matching within one fixed-width field.
+ *
+ * The field holds a NUL-terminated string (or, if malformed, exactly width
+ * characters). A match only counts if it lies before the terminator, which
+ * is what strstr() on the field would report.
+ *
+ * The vectorized versions compare the first and last character of key against
+ * every possible starting position at once and only memcmp() the middle of
+ * the surviving candidates. Their loads run on past the field into the
+ * records after it, so they are used only where avail, the bytes from f to
+ * the end of the last record, covers VEC_SPAN(width); nearer the end we fall
+ * back to memmem(). A search thus never reads past the records it was given,
+ * which is where mdb_append() writes.
+ */
+
+#if defined(__AVX2__)
+
+static inline uint32_t first_last_mask(const char *f, const char *key, size_t len,
+        uint32_t *nul)
+{
+    __m256i first = _mm256_set1_epi8(key[0]);
+    __m256i last = _mm256_set1_epi8(key[len - 1]);
+    __m256i a = _mm256_loadu_si256((const __m256i *)f);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(f + len - 1));
+
+    *nul = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, _mm256_setzero_si256()));
+    return _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+}
+
+#elif defined(__SSE2__)
+
+static inline uint32_t first_last_mask(const char *f, const char *key, size_t len,
+        uint32_t *nul)
+{
+    __m128i first = _mm_set1_epi8(key[0]);
+    __m128i last = _mm_set1_epi8(key[len - 1]);
+    __m128i zero = _mm_setzero_si128();
+    __m128i a0 = _mm_loadu_si128((const __m128i *)f);
+    __m128i a1 = _mm_loadu_si128((const __m128i *)(f + 16));
+    __m128i b0 = _mm_loadu_si128((const __m128i *)(f + len - 1));
+    __m128i b1 = _mm_loadu_si128((const __m128i *)(f + len - 1 + 16));
+
+    *nul = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a0, zero))
+        | (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a1, zero)) << 16;
+    return (uint32_t)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a0, first), _mm_cmpeq_epi8(b0, last)))
+        | (uint32_t)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a1, first), _mm_cmpeq_epi8(b1, last))) << 16;
+}
+
+#endif
+
+static inline int field_matches(const char *f, size_t width, size_t avail,
+        const char *key, size_t len)
+{
+    if (len > width)
+        return 0;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    if (avail < VEC_SPAN(width))
+        return memmem(f, strnlen(f, width), key, len) != NULL;
+
+    uint32_t nul;
+    uint32_t cand = first_last_mask(f, key, len, &nul);
+
+    // The string ends at the first NUL within the field.
+    nul &= (1u << width) - 1;
+    size_t end = nul ? (size_t)__builtin_ctz(nul) : width;
+    if (end < len)
+        return 0;
+
+    // Keep only the starting positions that leave room for all of key.
+    cand &= (1u << (end - len + 1)) - 1;
+
+    while (cand) {
+        size_t pos = __builtin_ctz(cand);
+        if (len <= 2 || memcmp(f + pos + 1, key + 1, len - 2) == 0)
+            return 1;
+        cand &= cand - 1;
+    }
+    return 0;
+#else
+    (void)avail;
+    return memmem(f, strnlen(f, width), key, len) != NULL;
+#endif
+}
+
+int mdb_matches(const struct Mdb *db, uint32_t i, const char *key, size_t len)
+{
+    if (len == 0)
+        return 1;
+
+    size_t left = db->count - i; // records from i on
+    return field_matches(mdb_name(db, i), MDB_NAME_LEN, left * MDB_NAME_LEN, key, len)
+        || field_matches(mdb_msg(db, i), MDB_MSG_LEN, left * MDB_MSG_LEN, key, len);
+}
+
+void mdb_scan(const struct Mdb *db, const char *key, size_t len,
+        void (*visit)(const struct Mdb *db, uint32_t i, void *arg), void *arg)
+{
+    for (uint32_t i = 0; i < db->count; i++)
+        if (mdb_matches(db, i, key, len))
+            visit(db, i, arg);
+}
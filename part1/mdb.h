@@ -1,9 +1,113 @@
 #ifndef __MDB_H__
 #define __MDB_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MDB_NAME_LEN 16
+#define MDB_MSG_LEN 24
+
 struct MdbRec {
-    char name[16];
-    char msg[24];
+    char name[MDB_NAME_LEN];
+    char msg[MDB_MSG_LEN];
+};
+
+/*
+ * In-memory database.
+ *
+ * Records are kept structure-of-arrays: all the names live in one contiguous
+ * buffer and all the messages in another, so a full scan streams through
+ * memory instead of chasing one malloc()'d node per record. Record i's name
+ * is at names + i * MDB_NAME_LEN and its message at msgs + i * MDB_MSG_LEN.
+ *
+ * Searches read only records [0, count), so a reader can search a copy of
+ * the struct while mdb_append() adds records after them.
+ */
+struct Mdb {
+    char *names;
+    char *msgs;
+    uint32_t count;
+    uint32_t capacity;
+    struct MdbIndex *index; // NULL unless mdb_build_index() was called
 };
 
+static inline const char *mdb_name(const struct Mdb *db, uint32_t i)
+{
+    return db->names + (size_t)i * MDB_NAME_LEN;
+}
+
+static inline const char *mdb_msg(const struct Mdb *db, uint32_t i)
+{
+    return db->msgs + (size_t)i * MDB_MSG_LEN;
+}
+
+/*
+ * Read all records from fp into db.
+ *
+ * Returns the number of records loaded; returns negative if failed, in which
+ * case db is left empty.
+ */
+int mdb_load(struct Mdb *db, FILE *fp);
+
+/*
+ * Release the memory held by db, including its index.
+ */
+void mdb_free(struct Mdb *db);
+
+/*
+ * Append r to db in place, without growing it.
+ *
+ * Records [0, count) are left untouched, and searches never read past them,
+ * so a reader searching a copy of *db taken before the append (see
+ * mdb-lookup-server.c) is unaffected. The index, if any, is not updated;
+ * mdb_search() scans records added after it was built.
+ *
+ * Returns the new record's number (from 0); returns negative if db is full.
+ */
+int mdb_append(struct Mdb *db, const struct MdbRec *r);
+
+/*
+ * Copy the records of src into dst, with room for capacity records in all.
+ * dst gets no index.
+ *
+ * Returns negative if failed, in which case dst is left empty.
+ */
+int mdb_clone(struct Mdb *dst, const struct Mdb *src, uint32_t capacity);
+
+/*
+ * Returns nonzero if key (of length len) occurs in record i's name or msg.
+ * An empty key matches every record, just like strstr() would.
+ */
+int mdb_matches(const struct Mdb *db, uint32_t i, const char *key, size_t len);
+
+/*
+ * Call visit() on every record that matches key, in record order.
+ */
+void mdb_scan(const struct Mdb *db, const char *key, size_t len,
+        void (*visit)(const struct Mdb *db, uint32_t i, void *arg), void *arg);
+
+/*
+ * Build a trigram index over the names and messages in db.
+ *
+ * Returns negative if failed, in which case db is left without an index and
+ * mdb_search() falls back to scanning.
+ */
+int mdb_build_index(struct Mdb *db);
+
+void mdb_free_index(struct Mdb *db);
+
+/*
+ * Returns the number of records added since the index was built, which
+ * mdb_search() has to scan, or db->count if there is no index.
+ */
+uint32_t mdb_unindexed(const struct Mdb *db);
+
+/*
+ * Same as mdb_scan(), but uses the trigram index when db has one and key is
+ * long enough to contain a trigram. Records are still visited in order.
+ */
+void mdb_search(const struct Mdb *db, const char *key, size_t len,
+        void (*visit)(const struct Mdb *db, uint32_t i, void *arg), void *arg);
+
 #endif
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access-log.h"
+
+static const char *log_path;   // NULL for stderr
+static int log_fd = -1;
+static struct log_ring **log_rings;
+static int log_nrings;
+static volatile sig_atomic_t reopen_requested;
+
+int log_ring_init(struct log_ring *r, size_t size)
+{
+    memset(r, 0, sizeof(*r));
+
+    r->size = 1;
+    while (r->size < size)
+        r->size *= 2;
+
+    r->data = malloc(r->size);
+    return r->data ? 0 : -1;
+}
+
+int log_ring_put(struct log_ring *r, const char *line, size_t len)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (len > r->size - (head - tail))
+        return -1;
+
+    // The line may wrap around the end of the buffer.
+    size_t off = head & (r->size - 1);
+    size_t first = len < r->size - off ? len : r->size - off;
+    memcpy(r->data + off, line, first);
+    memcpy(r->data, line + first, len - first);
+
+    // Publish the line only once it's all there.
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+    return 0;
+}
+
+void access_log_reopen(void)
+{
+    reopen_requested = 1;
+}
+
+static int open_log(void)
+{
+    if (log_path == NULL)
+        return STDERR_FILENO;
+
+    int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        perror(log_path);
+    return fd;
+}
+
+static void write_all(const struct iovec *iov, int iovcnt)
+{
+    struct iovec v[2];
+    memcpy(v, iov, iovcnt * sizeof(*iov));
+
+    while (iovcnt > 0) {
+        ssize_t n = writev(log_fd, v, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // Nowhere to complain but stderr, which may be the log itself.
+            return;
+        }
+        while (iovcnt > 0 && (size_t)n >= v[0].iov_len) {
+            n -= v[0].iov_len;
+            v[0] = v[1];
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            v[0].iov_base = (char *)v[0].iov_base + n;
+            v[0].iov_len -= n;
+        }
+    }
+}
+
+/*
+ * Write out everything queued in r, in at most two pieces since it may wrap
+ * around the end of the buffer.
+ */
+static void drain(struct log_ring *r)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (head == tail)
+        return;
+
+    size_t off = tail & (r->size - 1);
+    size_t len = head - tail;
+    size_t first = len < r->size - off ? len : r->size - off;
+
+    struct iovec iov[2] = {
+        { r->data + off, first },
+        { r->data, len - first },
+    };
+    if (log_fd >= 0)
+        write_all(iov, len > first ? 2 : 1);
+
+    atomic_store_explicit(&r->tail, head, memory_order_release);
+}
+
+static void *writer_main(void *arg)
+{
+    for (;;) {
+        struct timespec ts = { 0, ACCESS_LOG_FLUSH_MS * 1000000L };
+        nanosleep(&ts, NULL);
+
+        if (reopen_requested) {
+            reopen_requested = 0;
+            if (log_path) {
+                int fd = open_log();
+                if (fd >= 0) {
+                    if (log_fd >= 0)
+                        close(log_fd);
+                    log_fd = fd;
+                }
+            }
+        }
+
+        for (int i = 0; i < log_nrings; i++)
+            drain(log_rings[i]);
+    }
+
+    return NULL;
+}
+
+int access_log_start(const char *path, struct log_ring **rings, int n)
+{
+    log_path = path;
+    log_rings = rings;
+    log_nrings = n;
+
+    log_fd = open_log();
+    if (log_fd < 0)
+        return -1;
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, &writer_main, NULL);
+    if (err) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
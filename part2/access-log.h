@@ -0,0 +1,58 @@
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Asynchronous access log.
+ *
+ * Each http-server worker appends its log lines to its own ring buffer, and a
+ * background thread writes out whatever has piled up in all of them every
+ * ACCESS_LOG_FLUSH_MS, a batch per ring per write(). A worker never blocks
+ * on the log file: the ring has a single producer (the worker) and a single
+ * consumer (the writer), so it needs no lock, and a line that doesn't fit is
+ * dropped instead, for the worker to count.
+ *
+ * Lines are kept whole; the writer only ever sees complete lines.
+ */
+
+#define ACCESS_LOG_FLUSH_MS 50
+
+struct log_ring {
+    char *data;
+    size_t size;         // a power of two
+    _Atomic size_t head; // bytes ever put in by the worker
+    _Atomic size_t tail; // bytes ever taken out by the writer
+};
+
+/*
+ * Set up a ring holding size bytes, rounded up to a power of two.
+ *
+ * Returns negative if failed.
+ */
+int log_ring_init(struct log_ring *r, size_t size);
+
+/*
+ * Queue the len bytes at line, which should end with a newline. Only the
+ * ring's worker may call this.
+ *
+ * Returns negative if the line was dropped because the ring is full.
+ */
+int log_ring_put(struct log_ring *r, const char *line, size_t len);
+
+/*
+ * Start the writer thread draining the n rings into the file at path, or to
+ * stderr if path is NULL. No rings may be added later.
+ *
+ * Returns negative if failed.
+ */
+int access_log_start(const char *path, struct log_ring **rings, int n);
+
+/*
+ * Have the writer reopen the log file, e.g., after it was renamed away for
+ * rotation. Safe to call from signal handlers.
+ */
+void access_log_reopen(void);
+
+#endif
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "file-cache.h"
+
+#define FILE_CACHE_MAX_FILE (1 << 20) // Never cache files larger than 1 MB
+
+// Anything that could change what we would send for a file in the directory.
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+        | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+void file_cache_release(struct file_cache_entry *e)
+{
+    if (--e->refs == 0)
+        free(e);
+}
+
+static void evict_entry(struct lru_entry *e)
+{
+    // lru is the first member of struct file_cache_entry
+    file_cache_release((struct file_cache_entry *)e);
+}
+
+int file_cache_init(struct file_cache *fc, size_t max_bytes)
+{
+    memset(fc, 0, sizeof(*fc));
+
+    if (lru_init(&fc->lru, max_bytes, &evict_entry) < 0)
+        return -1;
+
+    fc->max_file_size = max_bytes / 8;
+    if (fc->max_file_size > FILE_CACHE_MAX_FILE)
+        fc->max_file_size = FILE_CACHE_MAX_FILE;
+
+    // Without inotify we still work; we just stat() on every hit.
+    fc->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fc->inotify_fd < 0)
+        perror("inotify_init1");
+
+    return 0;
+}
+
+/*
+ * Make sure the directory containing path is watched, if a watch on it tells
+ * us about every change to the file.
+ *
+ * That takes a canonical path: absolute, without "." or ".." components,
+ * doubled slashes or symbolic links, the file itself included. A file reached
+ * through a link can change without any event in the directory we'd watch,
+ * and clients could make up any number of spellings of one directory. As
+ * it is, each watched directory has the one spelling, which we remember, so
+ * that directory + "/" + name is the cache key of any file named in an event.
+ *
+ * Returns negative if path's directory isn't watched.
+ */
+static int watch_dir(struct file_cache *fc, const char *path)
+{
+    if (fc->inotify_fd < 0)
+        return -1;
+
+    char real[PATH_MAX];
+    if (realpath(path, real) == NULL || strcmp(real, path) != 0)
+        return -1;
+
+    // realpath() gives us an absolute path, so there is a slash.
+    size_t dir_len = strrchr(path, '/') - path;
+    char dir[PATH_MAX];
+    memcpy(dir, path, dir_len);
+    dir[dir_len] = '\0';
+
+    // The kernel hands out one wd per directory, however often we add it.
+    int wd = inotify_add_watch(fc->inotify_fd, dir_len ? dir : "/", WATCH_MASK);
+    if (wd < 0)
+        return -1;
+
+    // A directory mounted in two places still has one wd; events come to
+    // the spelling we have, so the other can't rely on them.
+    for (int i = 0; i < fc->nwatches; i++)
+        if (fc->watches[i].wd == wd)
+            return strcmp(fc->watches[i].dir, dir) == 0 ? 0 : -1;
+
+    if (fc->nwatches == fc->watch_cap) {
+        int cap = fc->watch_cap ? fc->watch_cap * 2 : 16;
+        struct file_cache_watch *watches = realloc(fc->watches, cap * sizeof(*watches));
+        if (watches == NULL)
+            return -1;
+        fc->watches = watches;
+        fc->watch_cap = cap;
+    }
+
+    char *copy = strdup(dir);
+    if (copy == NULL)
+        return -1;
+
+    fc->watches[fc->nwatches].wd = wd;
+    fc->watches[fc->nwatches].dir = copy;
+    fc->nwatches++;
+    return 0;
+}
+
+static int same_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+        && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec
+        && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+struct file_cache_entry *file_cache_lookup(struct file_cache *fc, const char *path)
+{
+    struct file_cache_entry *e = (struct file_cache_entry *)lru_get(&fc->lru, path);
+    if (e == NULL || e->watched)
+        return e;
+
+    // Not watched; revalidate against the file itself.
+    struct stat st;
+    if (stat(path, &st) < 0 || !same_file(&st, &e->st)) {
+        lru_remove(&fc->lru, &e->lru);
+        return NULL;
+    }
+    return e;
+}
+
+/*
+ * Allocate an entry for path with room for body_len bytes after hdr, and
+ * start watching its directory. Fill in the body before adding the entry.
+ */
+static struct file_cache_entry *new_entry(struct file_cache *fc, const char *path,
+        const struct stat *st, const char *hdr, size_t hdr_len, size_t body_len)
+{
+    size_t len = hdr_len + body_len;
+    struct file_cache_entry *e = malloc(sizeof(*e) + len);
+    if (e == NULL)
+        return NULL;
+
+    e->refs = 1;
+    e->st = *st;
+    e->hdr_len = hdr_len;
+    e->len = len;
+    memcpy(e->data, hdr, hdr_len);
+
+    // Watch before the body is read, so that any change after this point
+    // invalidates the entry.
+    e->watched = watch_dir(fc, path) == 0;
+    return e;
+}
+
+static struct file_cache_entry *add_entry(struct file_cache *fc, const char *path,
+        struct file_cache_entry *e)
+{
+    if (lru_put(&fc->lru, &e->lru, path, sizeof(*e) + e->len + strlen(path)) < 0) {
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+struct file_cache_entry *file_cache_insert(struct file_cache *fc, const char *path,
+        int fd, const struct stat *st, const char *hdr, size_t hdr_len)
+{
+    if (!S_ISREG(st->st_mode) || (size_t)st->st_size > fc->max_file_size)
+        return NULL;
+
+    struct file_cache_entry *e = new_entry(fc, path, st, hdr, hdr_len, st->st_size);
+    if (e == NULL)
+        return NULL;
+
+    size_t got = 0;
+    while (got < (size_t)st->st_size) {
+        ssize_t n = pread(fd, e->data + hdr_len + got, st->st_size - got, got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            // Error, or the file shrank since fstat(); don't cache it.
+            free(e);
+            return NULL;
+        }
+        got += n;
+    }
+
+    return add_entry(fc, path, e);
+}
+
+struct file_cache_entry *file_cache_insert_data(struct file_cache *fc, const char *path,
+        const struct stat *st, const char *hdr, size_t hdr_len, const void *data, size_t len)
+{
+    if (len > fc->max_file_size)
+        return NULL;
+
+    struct file_cache_entry *e = new_entry(fc, path, st, hdr, hdr_len, len);
+    if (e == NULL)
+        return NULL;
+
+    memcpy(e->data + hdr_len, data, len);
+    return add_entry(fc, path, e);
+}
+
+static void drop_entry(struct file_cache *fc, const char *path)
+{
+    struct lru_entry *e = lru_get(&fc->lru, path);
+    if (e)
+        lru_remove(&fc->lru, e);
+}
+
+static void forget_watch(struct file_cache *fc, int wd)
+{
+    for (int i = 0; i < fc->nwatches; ) {
+        if (fc->watches[i].wd == wd) {
+            free(fc->watches[i].dir);
+            fc->watches[i] = fc->watches[--fc->nwatches];
+        } else {
+            i++;
+        }
+    }
+}
+
+void file_cache_handle_events(struct file_cache *fc)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t n = read(fc->inotify_fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("inotify");
+            return;
+        }
+
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // We lost events, or a whole directory went away or moved;
+                // we can't tell which entries are stale, so drop them all.
+                if (ev->mask & IN_MOVE_SELF)
+                    inotify_rm_watch(fc->inotify_fd, ev->wd);
+                if (ev->mask & IN_IGNORED)
+                    forget_watch(fc, ev->wd);
+                lru_clear(&fc->lru);
+                continue;
+            }
+
+            if (ev->len == 0)
+                continue;
+
+            for (int i = 0; i < fc->nwatches; i++) {
+                if (fc->watches[i].wd != ev->wd)
+                    continue;
+
+                char path[PATH_MAX];
+                int len = snprintf(path, sizeof(path), "%s/%s", fc->watches[i].dir, ev->name);
+                if (len >= (int)sizeof(path))
+                    continue;
+
+                drop_entry(fc, path);
+
+                // An entry for a file may have been built from its
+                // precompressed sibling, so that one counts too.
+                if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+                    path[len - 3] = '\0';
+                    drop_entry(fc, path);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef __FILE_CACHE_H__
+#define __FILE_CACHE_H__
+
+#include <sys/stat.h>
+
+#include "lru.h"
+
+/*
+ * In-memory cache of small static files, keyed by file path.
+ *
+ * Each entry holds the response: the prebuilt status line and the headers
+ * that don't depend on the request, immediately followed by the file
+ * contents, so a hit costs no system calls at all.
+ *
+ * Entries are invalidated through inotify watches on the directories of the
+ * cached files. Entries for paths that aren't canonical (see watch_dir() in
+ * file-cache.c), or from directories that can't be watched, fall back to
+ * comparing the file's stat() result on every hit.
+ *
+ * Entries are reference counted so that a response can be sent straight from
+ * an entry even if the entry is evicted while the response is going out;
+ * take a reference with file_cache_hold() and drop it with
+ * file_cache_release().
+ */
+struct file_cache_entry {
+    struct lru_entry lru;
+    int refs;        // the cache's own plus one per holder
+    struct stat st;  // the file when it was cached
+    int watched;     // kept up to date by inotify; no need to stat()
+    size_t hdr_len;  // status line and headers come first in data
+    size_t len;      // total length of data
+    char data[];
+};
+
+struct file_cache_watch {
+    int wd;
+    char *dir;
+};
+
+struct file_cache {
+    struct lru lru;
+    size_t max_file_size; // larger files are never cached
+    int inotify_fd;       // -1 if inotify is unavailable
+    struct file_cache_watch *watches;
+    int nwatches;
+    int watch_cap;
+};
+
+/*
+ * Set up a cache holding at most max_bytes of responses.
+ *
+ * Returns negative if failed.
+ */
+int file_cache_init(struct file_cache *fc, size_t max_bytes);
+
+/*
+ * Returns the cached response for path, or NULL if we don't have an
+ * up-to-date one.
+ */
+struct file_cache_entry *file_cache_lookup(struct file_cache *fc, const char *path);
+
+/*
+ * Read the file open on fd (whose stat() result is st) and cache it under
+ * path together with the response headers in hdr.
+ *
+ * Returns the new entry, or NULL if the file was not cached, e.g., because it
+ * is too large. fd is left open either way.
+ */
+struct file_cache_entry *file_cache_insert(struct file_cache *fc, const char *path,
+        int fd, const struct stat *st, const char *hdr, size_t hdr_len);
+
+static inline void file_cache_hold(struct file_cache_entry *e)
+{
+    e->refs++;
+}
+
+/*
+ * Drop a reference taken with file_cache_hold(), freeing e if it was the last.
+ */
+void file_cache_release(struct file_cache_entry *e);
+
+/*
+ * Cache the len bytes at data under path together with the response headers
+ * in hdr, as the response for the file whose stat() result is st. Changes to
+ * path, or to path.gz, invalidate the entry.
+ *
+ * Returns the new entry, or NULL if it was not cached.
+ */
+struct file_cache_entry *file_cache_insert_data(struct file_cache *fc, const char *path,
+        const struct stat *st, const char *hdr, size_t hdr_len, const void *data, size_t len);
+
+/*
+ * Process pending inotify events on fc->inotify_fd, dropping entries for
+ * files that changed.
+ */
+void file_cache_handle_events(struct file_cache *fc);
+
+#endif
@@ -0,0 +1,205 @@
+#include "http-parser.h"
+
+/*
+ * Characters allowed in methods and header names (tchar in RFC 9110, 5.6.2).
+ */
+static const unsigned char tchar[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x00
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x10
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, //  !"#$%&'()*+,-./
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, // 0123456789:;<=>?
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // @ABCDEFGHIJKLMNO
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1, // PQRSTUVWXYZ[\]^_
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // `abcdefghijklmno
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0, // pqrstuvwxyz{|}~
+    // The rest are 0.
+};
+
+/*
+ * Characters allowed in the request URI and version: anything visible.
+ */
+static inline int is_vchar(unsigned char ch)
+{
+    return ch > ' ' && ch != 0x7f;
+}
+
+void http_parser_init(struct http_parser *p, size_t max_len)
+{
+    // The headers array is filled in as we go, so it needn't be cleared.
+    p->state = HTTP_START;
+    p->pos = p->mark = p->value_end = 0;
+    p->max_len = max_len;
+    p->method = p->uri = p->version = (struct http_slice){ NULL, 0 };
+    p->nheaders = 0;
+    p->header_len = 0;
+}
+
+int http_parse(struct http_parser *p, const char *buf, size_t len)
+{
+    const unsigned char *s = (const unsigned char *)buf;
+    size_t i = p->pos;
+    size_t end = len < p->max_len ? len : p->max_len;
+
+    // Each state scans as far as it can in one go, then either moves on to
+    // the next state or runs out of input and waits for more.
+    while (i < end) {
+        switch (p->state) {
+        case HTTP_START:
+            // Ignore empty lines in front of the request line (RFC 9112, 2.2).
+            if (s[i] == '\r' || s[i] == '\n') {
+                i++;
+                break;
+            }
+            p->mark = i;
+            p->state = HTTP_METHOD;
+            // fall through
+
+        case HTTP_METHOD:
+            while (i < end && tchar[s[i]])
+                i++;
+            if (i == end)
+                break;
+            if ((s[i] != ' ' && s[i] != '\t') || i == p->mark)
+                return 400; // "Bad Request"
+            p->method = (struct http_slice){ buf + p->mark, i - p->mark };
+            p->state = HTTP_SP_URI;
+            break;
+
+        case HTTP_SP_URI:
+            while (i < end && (s[i] == ' ' || s[i] == '\t'))
+                i++;
+            if (i == end)
+                break;
+            p->mark = i;
+            p->state = HTTP_URI;
+            // fall through
+
+        case HTTP_URI:
+            while (i < end && is_vchar(s[i]))
+                i++;
+            if (i == end)
+                break;
+            if (s[i] != ' ' && s[i] != '\t')
+                return 400; // "Bad Request"
+            p->uri = (struct http_slice){ buf + p->mark, i - p->mark };
+            p->state = HTTP_SP_VERSION;
+            break;
+
+        case HTTP_SP_VERSION:
+            while (i < end && (s[i] == ' ' || s[i] == '\t'))
+                i++;
+            if (i == end)
+                break;
+            p->mark = i;
+            p->state = HTTP_VERSION;
+            // fall through
+
+        case HTTP_VERSION:
+            while (i < end && is_vchar(s[i]))
+                i++;
+            if (i == end)
+                break;
+            if ((s[i] != '\r' && s[i] != '\n') || i == p->mark)
+                return 400; // "Bad Request"
+            p->version = (struct http_slice){ buf + p->mark, i - p->mark };
+            p->state = s[i++] == '\r' ? HTTP_LINE_LF : HTTP_LINE_START;
+            break;
+
+        case HTTP_LINE_LF:
+            if (s[i++] != '\n')
+                return 400; // "Bad Request"
+            p->state = HTTP_LINE_START;
+            break;
+
+        case HTTP_LINE_START:
+            if (s[i] == '\r') {
+                i++;
+                p->state = HTTP_END_LF;
+                break;
+            }
+            if (s[i] == '\n') {
+                i++;
+                goto done;
+            }
+            // No line folding (obs-fold) either.
+            if (!tchar[s[i]])
+                return 400; // "Bad Request"
+            if (p->nheaders == HTTP_MAX_HEADERS)
+                return 431; // "Request Header Fields Too Large"
+            p->mark = i;
+            p->state = HTTP_NAME;
+            // fall through
+
+        case HTTP_NAME:
+            while (i < end && tchar[s[i]])
+                i++;
+            if (i == end)
+                break;
+            if (s[i] != ':')
+                return 400; // "Bad Request"
+            p->headers[p->nheaders].name = (struct http_slice){ buf + p->mark, i - p->mark };
+            i++;
+            p->state = HTTP_VALUE_OWS;
+            // fall through
+
+        case HTTP_VALUE_OWS:
+            while (i < end && (s[i] == ' ' || s[i] == '\t'))
+                i++;
+            if (i == end)
+                break;
+            p->mark = p->value_end = i;
+            p->state = HTTP_VALUE;
+            // fall through
+
+        case HTTP_VALUE:
+            for (; i < end; i++) {
+                if (s[i] == '\r' || s[i] == '\n')
+                    break;
+                // Control characters other than tab never belong in a value.
+                if ((s[i] < ' ' && s[i] != '\t') || s[i] == 0x7f)
+                    return 400; // "Bad Request"
+                if (s[i] != ' ' && s[i] != '\t')
+                    p->value_end = i + 1;
+            }
+            if (i == end)
+                break;
+            p->headers[p->nheaders++].value =
+                (struct http_slice){ buf + p->mark, p->value_end - p->mark };
+            p->state = s[i++] == '\r' ? HTTP_LINE_LF : HTTP_LINE_START;
+            break;
+
+        case HTTP_END_LF:
+            if (s[i++] != '\n')
+                return 400; // "Bad Request"
+            goto done;
+
+        case HTTP_DONE:
+            return 200;
+        }
+    }
+
+    if (p->state == HTTP_DONE)
+        return 200;
+
+    p->pos = i;
+    if (end < p->max_len)
+        return 0;
+
+    // We've seen as much as we take and it's still not over.
+    if (p->state <= HTTP_VERSION)
+        return 414; // "URI Too Long"
+    return 431; // "Request Header Fields Too Large"
+
+done:
+    p->pos = p->header_len = i;
+    p->state = HTTP_DONE;
+    return 200;
+}
+
+const struct http_slice *http_find_header(const struct http_parser *p, const char *name)
+{
+    for (int i = 0; i < p->nheaders; i++)
+        if (http_slice_caseeq(p->headers[i].name, name))
+            return &p->headers[i].value;
+    return NULL;
+}
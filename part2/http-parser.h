@@ -0,0 +1,106 @@
+#ifndef __HTTP_PARSER_H__
+#define __HTTP_PARSER_H__
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * Incremental HTTP/1.x request parser.
+ *
+ * The parser works directly on the connection's read buffer: call
+ * http_parse() every time more of the request has arrived, and it picks up
+ * where it left off, so each byte is looked at once no matter how the request
+ * was split across reads. It never copies or modifies the buffer; the
+ * request line and headers come back as slices pointing into it, which stay
+ * valid as long as the buffer does.
+ *
+ * Only the request line and headers are parsed; the body, if any, is the
+ * caller's business.
+ */
+
+#define HTTP_MAX_HEADERS 64 // More headers than this is an error (431)
+
+/*
+ * len bytes at p, not NUL-terminated.
+ */
+struct http_slice {
+    const char *p;
+    size_t len;
+};
+
+struct http_header {
+    struct http_slice name;
+    struct http_slice value; // without surrounding whitespace
+};
+
+enum http_parse_state {
+    HTTP_START,      // skipping empty lines in front of the request line
+    HTTP_METHOD,
+    HTTP_SP_URI,     // whitespace between method and request URI
+    HTTP_URI,
+    HTTP_SP_VERSION, // whitespace between request URI and version
+    HTTP_VERSION,
+    HTTP_LINE_LF,    // a line ended with CR; LF must follow
+    HTTP_LINE_START, // start of a header line, or of the empty line
+    HTTP_NAME,
+    HTTP_VALUE_OWS,  // whitespace between colon and value
+    HTTP_VALUE,
+    HTTP_END_LF,     // the empty line started with CR; LF must follow
+    HTTP_DONE,
+};
+
+struct http_parser {
+    enum http_parse_state state;
+    size_t pos;       // bytes of the buffer looked at so far
+    size_t max_len;   // longest request line and headers we take
+    size_t mark;      // start of the token being parsed
+    size_t value_end; // end of the header value so far, less trailing whitespace
+
+    struct http_slice method, uri, version;
+    struct http_header headers[HTTP_MAX_HEADERS];
+    int nheaders;
+    size_t header_len; // request line and headers, empty line included
+};
+
+/*
+ * Get p ready for a new request whose request line and headers may take up
+ * to max_len bytes.
+ */
+void http_parser_init(struct http_parser *p, size_t max_len);
+
+/*
+ * Parse on in the len bytes at buf, which must be the same buffer as in the
+ * previous calls for this request, grown only at the end.
+ *
+ * Returns 200 once the request line and headers are complete, 0 if we need
+ * more, or the error status to reject the request with: 400 if it is
+ * malformed, 414 if the request line or 431 if the headers are too long, or
+ * 431 if there are too many headers.
+ */
+int http_parse(struct http_parser *p, const char *buf, size_t len);
+
+/*
+ * Find the first header called name, ignoring case, in a parsed request.
+ *
+ * Returns NULL if there is no such header.
+ */
+const struct http_slice *http_find_header(const struct http_parser *p, const char *name);
+
+/*
+ * Returns nonzero if s is exactly str.
+ */
+static inline int http_slice_eq(struct http_slice s, const char *str)
+{
+    return strlen(str) == s.len && memcmp(s.p, str, s.len) == 0;
+}
+
+/*
+ * Returns nonzero if s is str, ignoring case.
+ */
+static inline int http_slice_caseeq(struct http_slice s, const char *str)
+{
+    return strlen(str) == s.len && strncasecmp(s.p, str, s.len) == 0;
+}
+
+#endif
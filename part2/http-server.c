@@ -1,19 +1,69 @@
 #define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <linux/limits.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
-#define MAXPENDING 5          // Maximum outstanding connection requests
+#include "../part1/mdb-proto.h"
+#include "access-log.h"
+#include "file-cache.h"
+#include "http-parser.h"
+#include "lookup-cache.h"
+#include "metrics.h"
+#include "timer-wheel.h"
+
+#define MAXPENDING 128        // Default listen() backlog per worker
 #define MAX_LINE_LENGTH 1024  // Maximum line length for request and headers
+#define MAX_REQUEST_SIZE 8192 // Maximum size of request line, headers, and body
 #define DISK_IO_BUF_SIZE 4096 // Size of buffer for reading and sending files
+#define BACKEND_BUF_SIZE 4096 // Size of buffer for reading mdb-lookup results
+#define MAX_EVENTS 256        // Maximum events handled per epoll_wait()
+#define DEFAULT_CACHE_SIZE (16 << 20) // Default file cache size per worker
+#define DEFAULT_LOOKUP_CACHE_SIZE (4 << 20) // Default lookup cache size per worker
+#define DEFAULT_LOOKUP_CACHE_TTL 30   // Seconds a cached lookup result stays fresh
+#define DEFAULT_GZIP_CACHE_SIZE (8 << 20) // Default gzip cache size per worker
+#define GZIP_MIN_SIZE 256             // Smaller files aren't worth compressing
+#define DEFAULT_KEEPALIVE_TIMEOUT 5   // Seconds to wait for the next request
+#define DEFAULT_HEADER_TIMEOUT 10     // Seconds to receive a whole request
+#define DEFAULT_WRITE_TIMEOUT 30      // Seconds a client may take no response data
+#define DEFAULT_MAX_REQUESTS 100      // Requests served per connection
+#define DEFAULT_MAX_CONNS 4096        // Open client connections per worker
+#define DEFAULT_MAX_LOOKUPS 256       // Lookups waiting or in flight per worker
+#define RETRY_AFTER 1                 // Seconds a client turned away should wait
+#define DEFAULT_BACKEND_CONNS 4       // mdb-lookup connections per worker
+#define DEFAULT_BACKEND_POOL 64       // ... but no more than this over all workers
+#define DEFAULT_BACKEND_TIMEOUT 10     // Seconds a lookup may take
+#define BACKEND_MIN_BACKOFF 100       // Milliseconds before the first reconnect
+#define BACKEND_MAX_BACKOFF 5000      // Longest delay between reconnects
+#define BACKEND_PIPELINE_DEPTH 32     // Binary lookups in flight per connection
+
+// Text protocol handshake: a key longer than any record field, which matches
+// nothing and is answered with just the empty line.
+#define BACKEND_PROBE "~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~"
+#define LOG_RING_SIZE (256 << 10)     // Access log buffer per worker
+#define LOG_LINE_MAX 1024             // Longer log lines are cut short
+#define MAX_RANGES 16                 // More byte ranges than this get the whole file
+
+#define STR_(x) #x
+#define STR(x) STR_(x) // the value of macro x as a string literal
 
 static void die(const char *message)
 {
@@ -32,6 +82,7 @@ static struct {
     { 201, "Created" },
     { 202, "Accepted" },
     { 204, "No Content" },
+    { 206, "Partial Content" },
     { 301, "Moved Permanently" },
     { 302, "Moved Temporarily" },
     { 304, "Not Modified" },
@@ -39,6 +90,12 @@ static struct {
     { 401, "Unauthorized" },
     { 403, "Forbidden" },
     { 404, "Not Found" },
+    { 408, "Request Timeout" },
+    { 411, "Length Required" },
+    { 413, "Payload Too Large" },
+    { 414, "URI Too Long" },
+    { 416, "Range Not Satisfiable" },
+    { 431, "Request Header Fields Too Large" },
     { 500, "Internal Server Error" },
     { 501, "Not Implemented" },
     { 502, "Bad Gateway" },
@@ -55,510 +112,3224 @@ static inline const char *get_reason_phrase(int status_code)
     return "Unknown Status Code";
 }
 
+/*
+ * Growable byte buffer.
+ */
+struct buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static int buf_reserve(struct buf *b, size_t n)
+{
+    if (b->len + n <= b->cap)
+        return 0;
+
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + n)
+        cap *= 2;
+
+    char *data = realloc(b->data, cap);
+    if (data == NULL)
+        return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_append(struct buf *b, const void *data, size_t n)
+{
+    if (n == 0)
+        return 0;
+    if (buf_reserve(b, n) < 0)
+        return -1;
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+    return 0;
+}
+
+static int buf_printf(struct buf *b, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || buf_reserve(b, n + 1) < 0)
+        return -1;
+
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, n + 1, fmt, ap);
+    va_end(ap);
+    b->len += n;
+    return n;
+}
+
+/*
+ * Append n bytes of text at s with the characters that are special in HTML
+ * escaped, so that records show as they were written.
+ */
+static int buf_append_html(struct buf *b, const char *s, size_t n)
+{
+    const char *end = s + n;
+
+    while (s < end) {
+        const char *p = s;
+        while (p < end && *p != '<' && *p != '>' && *p != '&')
+            p++;
+        if (buf_append(b, s, p - s) < 0)
+            return -1;
+        if (p == end)
+            break;
+
+        const char *esc = *p == '<' ? "&lt;" : *p == '>' ? "&gt;" : "&amp;";
+        if (buf_append(b, esc, strlen(esc)) < 0)
+            return -1;
+        s = p + 1;
+    }
+    return 0;
+}
+
+static void buf_free(struct buf *b)
+{
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/*
+ * One part of a multipart/byteranges response: the bytes [start, end) of the
+ * file, after the part's headers, which are kept in the connection's body at
+ * hdr_off.
+ */
+struct byte_range {
+    off_t start, end;
+    size_t hdr_off, hdr_len;
+};
+
+/*
+ * Per-connection state.
+ *
+ * Every client socket is non-blocking and registered edge-triggered with the
+ * server's epoll instance. A connection moves through these states:
+ *
+ *   CONN_READING: accumulating the request in req, which parser goes over
+ *                 as it comes in.
+ *   CONN_WAITING: waiting for the mdb-lookup backend to finish our result.
+ *   CONN_WRITING: sending out and then data in one sendmsg() where we can,
+ *                 then the byte range [file_off, file_end) of file_fd if
+ *                 we're serving a file. data points to the body wherever it
+ *                 already is (body, or a cache entry we hold a reference
+ *                 to), so it is never copied; the file is sent with
+ *                 sendfile(), so its contents never pass through user space.
+ *                 A multipart byte range response goes out a part at a
+ *                 time, each part being sent the same way: its headers in
+ *                 out, then its range in data or from file_fd.
+ *
+ * Once the response is sent, the request is logged. If the connection is
+ * persistent, it goes back to CONN_READING for the next request, which may
+ * already be sitting in req behind the one we just answered (pipelining);
+ * otherwise it is closed.
+ *
+ * The connection's timer bounds how long each state may take: a request has
+ * header_timeout seconds to arrive in full (408 if it was started, otherwise
+ * the connection is just closed), an idle persistent connection
+ * keepalive_timeout seconds for the next one to start, and a client that
+ * stops taking the response write_timeout seconds before we give up on it.
+ * While CONN_WAITING, the lookup's own timer covers us: it has
+ * backend_timeout seconds to get a backend connection, and as long again for
+ * the answer.
+ */
+enum conn_state {
+    CONN_READING,
+    CONN_WAITING,
+    CONN_WRITING,
+};
+
+struct server;
+
+struct conn {
+    int fd; // -1 once closed
+    enum conn_state state;
+    struct server *srv;
+    char clnt_ip[INET_ADDRSTRLEN];
+
+    // Note: we'll use these fields at the end when we log the connection.
+    char req[MAX_REQUEST_SIZE + 1];
+    size_t req_len;
+    size_t req_end; // end of the current request (headers and body) in req
+    size_t content_length; // length of the body at the end of the request
+    struct http_parser parser; // request line and headers of the current request
+    char *method, *request_uri, *http_version; // point into req once handled
+    int status_code;
+    int keep_alive; // keep the connection open after this response
+    int nrequests;  // requests received on this connection so far
+    int accept_gzip; // the client takes Content-Encoding: gzip
+    enum metrics_route route;
+    long long started_us; // when we had the whole request, or 0
+
+    struct buf body; // generated body, until we know its length
+    struct buf out;  // status line and headers
+    const char *data; // body to send after out
+    size_t data_len;
+    struct file_cache_entry *file_ref;     // data belongs to this entry, or
+    struct lookup_cache_entry *lookup_ref; // this one
+    size_t out_sent; // bytes of out and data already sent
+    int file_fd;     // file to send after out, or -1
+    off_t file_off;
+    off_t file_end;
+    int no_sendfile; // fall back to copying file_fd through io_buf
+    struct byte_range *ranges; // parts of a multipart response, or NULL
+    int nranges;
+    int next_range;            // the next part to queue once the current one is out
+    const char *range_data;    // the file the parts come from if cached, or NULL
+
+    struct conn *next; // next waiting for the same lookup, or in the closed list
+    struct conn *ready_next; // next in the ready list
+    int on_ready;            // already in the ready list
+    struct timer timer; // read, keep-alive or write timeout; see above
+};
+
+/*
+ * One query to mdb-lookup-server.
+ *
+ * Connections asking for a key that is already being looked up wait for the
+ * outstanding lookup instead of starting another one, so a burst of requests
+ * for the same key costs the backend a single search. The result page is
+ * rendered once, into body, and copied to every waiter.
+ */
+struct lookup {
+    struct lru_entry lru;       // in the server's in-flight table while lru.key
+    char key[MDB_KEY_LEN + 1];  // normalized key, or name of the record to add
+    int add;                    // add a record rather than search
+    char msg[MDB_KEY_LEN + 1];  // message of the record to add
+    unsigned generation;        // lookup cache generation when we started
+    struct buf body;            // rendered result page
+    struct conn *waiters;       // connections waiting for the result
+    struct lookup *next;        // next in the pending or in-flight list
+    uint32_t id;                // binary protocol request id
+    struct server *srv;
+    struct backend *be;         // connection it was sent on, if it has been
+    struct timer timer;         // backend_timeout while pending, again once sent
+    long long sent_us;          // when it was sent
+};
+
+/*
+ * Connection to mdb-lookup-server.
+ *
+ * Each worker keeps a pool of these. With the text protocol, each carries one
+ * lookup at a time: we send the key, and the result is a series of lines
+ * terminated by an empty line. With the binary protocol (see mdb-proto.h),
+ * up to BACKEND_PIPELINE_DEPTH lookups are sent without waiting, and their
+ * answers come back in the same order. Lookups wait on the server's pending
+ * list until a connection has room, so a slow lookup holds up only the ones
+ * behind it on its own connection.
+ *
+ * A connection gets lookups only once the server has answered a handshake on
+ * it, so one the server accepts but doesn't take on (because it has too many
+ * clients) never holds any. A connection that fails or stops answering is
+ * closed and reopened after a delay that doubles with every consecutive
+ * failure; the delay starts over only once a handshake succeeds.
+ */
+struct backend {
+    struct server *srv;
+    int fd;        // -1 if not connected
+    int connected; // connect() has completed
+    int ready;     // the server has answered our handshake
+    struct buf out;
+    size_t out_sent;
+    char in[BACKEND_BUF_SIZE];
+    size_t in_len;
+    int rows;                // result rows received for the oldest lookup
+    uint32_t rows_left;      // binary: records still to come for it
+    int in_answer;           // binary: we've had its answer header
+    struct lookup *inflight_head, *inflight_tail; // lookups sent, oldest first
+    int ninflight;
+    uint32_t next_id;        // binary: id for the next request
+    long long connected_ms; // when the handshake completed
+    struct timer retry; // reconnect while fd is -1, else give up on the handshake
+    int backoff;        // current reconnect delay (ms)
+};
+
+/*
+ * A --cache-control rule: files whose path under web-root starts with prefix
+ * may be cached by clients for max_age seconds. The longest matching prefix
+ * wins.
+ */
+struct cache_rule {
+    const char *prefix;
+    size_t prefix_len;
+    long max_age;
+};
+
+/*
+ * State of one worker's event loop.
+ *
+ * Each worker thread has its own listening socket (bound with SO_REUSEPORT so
+ * the kernel spreads incoming connections across them), epoll instance, and
+ * backend connections. Nothing on the request path is shared between workers.
+ */
+struct server {
+    int epfd;
+    int serv_fd;
+    const char *web_root;
+    struct sockaddr_storage mdb_addr;
+    socklen_t mdb_addr_len;
+    struct backend *backends;
+    int nbackends;
+    int binary_backend; // speak the binary protocol to mdb-lookup-server
+    struct lookup *pending_head, *pending_tail; // lookups waiting for a backend
+    struct lru inflight; // pending and in-flight lookups by key
+    struct file_cache files; // files.lru.max_bytes == 0 means no caching
+    struct lookup_cache lookups; // likewise for lookup results
+    struct file_cache gzips;     // gzip responses by file path; 0 disables gzip
+    const struct cache_rule *cache_rules; // Cache-Control max-age by path prefix
+    int ncache_rules;
+    int keepalive_timeout;   // seconds
+    int header_timeout;      // seconds
+    int write_timeout;       // seconds
+    int backend_timeout;     // seconds
+    int max_requests;        // per connection
+    int max_conns;           // open client connections; more get a 503
+    int nconns;
+    int max_lookups;         // backend lookups waiting or in flight; likewise
+    int nlookups;
+    struct timer_wheel timers; // every connection, lookup and reconnect timeout
+    struct conn *ready;  // connections with a pipelined request to handle
+    struct conn *closed; // closed connections to be freed after this round
+    struct metrics metrics; // updated only by this worker
+    struct log_ring log;    // access log lines for the writer thread
+    int log_sample;         // log every log_sample'th request
+    unsigned long nlogged;  // requests that could have been logged
+    char io_buf[DISK_IO_BUF_SIZE];
+};
+
+/*
+ * Every worker, for /server-status to add up their metrics.
+ */
+static struct server *servers;
+static int nservers;
+
+static const char mdb_lookup_form[] =
+    "<html><body>\n"
+    "<h1>mdb-lookup</h1>\n"
+    "<p>\n"
+    "<form method=GET action=/mdb-lookup>\n"
+    "lookup: <input type=text name=key>\n"
+    "<input type=submit>\n"
+    "</form>\n"
+    "<p>\n";
+
+static const char mdb_add_form[] =
+    "<html><body>\n"
+    "<h1>mdb-add</h1>\n"
+    "<p>\n"
+    "<form method=POST action=/mdb-add>\n"
+    "name: <input type=text name=name maxlength=15>\n"
+    "msg: <input type=text name=msg maxlength=23>\n"
+    "<input type=submit>\n"
+    "</form>\n"
+    "<p>\n";
+
 /*
  * Send HTTP status line.
  *
  * Returns negative if send() failed.
  */
-static int send_status_line(FILE *fp, int status_code)
+static int send_status_line(struct conn *c, int status_code)
 {
     const char *reason_phrase = get_reason_phrase(status_code);
-    return fprintf(fp, "HTTP/1.0 %d %s\r\n", status_code, reason_phrase);
+    return buf_printf(&c->out, "HTTP/1.1 %d %s\r\n", status_code, reason_phrase);
 }
 
 /*
- * Send blank line.
+ * Send the Connection header and the blank line that ends the headers.
  *
- * Returns number of bytes sent; returns negative if failed.
+ * Returns negative if failed.
  */
-static int send_blank_line(FILE *fp)
+static int send_end_of_headers(struct conn *c)
 {
-    return fprintf(fp, "\r\n");
+    return buf_printf(&c->out, "Connection: %s\r\n\r\n",
+            c->keep_alive ? "keep-alive" : "close");
 }
 
 /*
- * Send a generic HTTP response for error statuses (400+).
+ * Send the rest of a response whose body is the len bytes at data: its
+ * Content-Length, the end of the headers, and the body itself. The status
+ * line and any other headers must already have been sent.
+ *
+ * The body is sent from where it is, so it must stay put until the response
+ * is out.
  *
  * Returns negative if failed.
  */
-static int send_error_status(FILE *fp, int status_code)
+static int send_data(struct conn *c, const char *data, size_t len)
 {
-    if (send_status_line(fp, status_code) < 0)
+    if (buf_printf(&c->out, "Content-Length: %zu\r\n", len) < 0)
         return -1;
-    // no headers needed
-    if (send_blank_line(fp) < 0)
+    if (send_end_of_headers(c) < 0)
         return -1;
+    c->data = data;
+    c->data_len = len;
+    return 0;
+}
 
-    return fprintf(fp,
-        "<html><body>\n"
-        "<h1>%d %s</h1>\n"
-        "</body></html>\n",
-        status_code, get_reason_phrase(status_code));
+/*
+ * Send the body we generated in c->body (see send_data()).
+ */
+static int send_body(struct conn *c)
+{
+    return send_data(c, c->body.data, c->body.len);
 }
 
 /*
- * Send 301 status: redirect the browser to request_uri with '/' appended to it.
+ * Forget the body queued by send_data() and drop any cache entry it
+ * belongs to.
+ */
+static void release_data(struct conn *c)
+{
+    if (c->file_ref)
+        file_cache_release(c->file_ref);
+    if (c->lookup_ref)
+        lookup_cache_release(c->lookup_ref);
+    c->file_ref = NULL;
+    c->lookup_ref = NULL;
+    c->data = NULL;
+    c->data_len = 0;
+    free(c->ranges);
+    c->ranges = NULL;
+    c->nranges = c->next_range = 0;
+    c->range_data = NULL;
+}
+
+/*
+ * Tell caches that a file response depends on Accept-Encoding.
+ *
+ * Returns negative if failed.
+ */
+static int send_vary(struct conn *c)
+{
+    if (c->srv->gzips.lru.max_bytes == 0)
+        return 0;
+    return buf_printf(&c->out, "Vary: Accept-Encoding\r\n");
+}
+
+/*
+ * Send a generic HTTP response for error statuses (400+), replacing anything
+ * we may already have queued for this request.
  *
  * Returns negative if failed.
  */
-static int send301(const char *request_uri, FILE *fp)
+static int send_error_status(struct conn *c, int status_code)
 {
-    if (send_status_line(fp, 301) < 0)
+    c->out.len = 0;
+    c->body.len = 0;
+    release_data(c);
+
+    if (buf_printf(&c->body,
+            "<html><body>\n"
+            "<h1>%d %s</h1>\n"
+            "</body></html>\n",
+            status_code, get_reason_phrase(status_code)) < 0)
         return -1;
 
-    // Send Location header and format redirection link in HTML in case browser
-    // doesn't automatically redirect.
-    return fprintf(fp,
-        "Location: %s/\r\n"
-        "\r\n"
-        "<html><body>\n"
-        "<h1>301 Moved Permanently</h1>\n"
-        "<p>The document has moved "
-        "<a href=\"%s/\">here</a>.</p>\n"
-        "</body></html>\n",
-        request_uri, request_uri);
+    if (send_status_line(c, status_code) < 0)
+        return -1;
+    // We're overloaded (or the backend is down); say when to come back.
+    if (status_code == 503 && buf_printf(&c->out, "Retry-After: %d\r\n", RETRY_AFTER) < 0)
+        return -1;
+    return send_body(c);
 }
 
 /*
- * Handle static file requests.
- * Returns the HTTP status code that was sent to the browser.
+ * Send 301 status: redirect the browser to request_uri with '/' appended to it.
  *
- * If send() ever fails (i.e., could not write to clnt_w), report the error and
- * move on.
+ * Returns negative if failed.
  */
-static int handle_file_request(const char *web_root, const char *request_uri, FILE *clnt_w)
+static int send301(const char *request_uri, struct conn *c)
 {
-    /*
-     * Define variables that we will need to use before we return.
-     */
- int status_code; // We'll return this value.
-    FILE *fp = NULL; // We'll fclose() this at the end.
+    // Format redirection link in HTML in case browser doesn't automatically
+    // redirect.
+    if (buf_printf(&c->body,
+            "<html><body>\n"
+            "<h1>301 Moved Permanently</h1>\n"
+            "<p>The document has moved "
+            "<a href=\"%s/\">here</a>.</p>\n"
+            "</body></html>\n",
+            request_uri) < 0)
+        return -1;
 
-    // Set clnt_w to line-buffering so that lines are flushed immediately.
-    setlinebuf(clnt_w);
+    if (send_status_line(c, 301) < 0)
+        return -1;
+    // Send Location header.
+    if (buf_printf(&c->out, "Location: %s/\r\n", request_uri) < 0)
+        return -1;
+    return send_body(c);
+}
 
-    /*
-     * Construct the path of the requested file from web_root and request_uri.
-     */
+/*
+ * Validators and conditional requests.
+ *
+ * A file's ETag is made of its inode number, size, and modification time, so
+ * it changes whenever the file is written or replaced. The gzip-encoded
+ * response is a different representation and gets an ETag of its own, made
+ * from the same file: file.gz is taken to be a compressed copy of file.
+ * A request whose If-None-Match (or, failing that, If-Modified-Since) shows
+ * that the client's copy is still current gets a 304 without the body.
+ */
 
-    char file_path[PATH_MAX];
+static int make_etag(char *dst, size_t size, const struct stat *st, int gzip)
+{
+    return snprintf(dst, size, "\"%llx-%llx-%llx%s\"",
+            (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+            (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec,
+            gzip ? "-gz" : "");
+}
 
-    if (strlen(web_root) + strlen(request_uri) + 12 > sizeof(file_path)) {
-        // File paths can't exceed sizeof(file_path) on Linux, so just 404.
-        status_code = 404; // "Not Found"
-        if (send_error_status(clnt_w, status_code) < 0)
-            perror("send");
-        goto cleanup;
+static void format_http_date(char *dst, size_t size, time_t t)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(dst, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+static const struct cache_rule *find_cache_rule(struct server *srv, const char *file_path)
+{
+    // file_path is web_root followed by the request URI.
+    const char *path = file_path + strlen(srv->web_root);
+    const struct cache_rule *best = NULL;
+
+    for (int i = 0; i < srv->ncache_rules; i++) {
+        const struct cache_rule *r = &srv->cache_rules[i];
+        if (strncmp(path, r->prefix, r->prefix_len) == 0
+                && (best == NULL || r->prefix_len > best->prefix_len))
+            best = r;
     }
+    return best;
+}
 
-    strcpy(file_path, web_root);
+/*
+ * Format the ETag, Last-Modified, and (if a rule covers file_path)
+ * Cache-Control headers for the file at file_path, whose stat() result is st,
+ * into the size bytes at dst.
+ *
+ * Returns the length of the headers.
+ */
+static int format_validators(struct server *srv, char *dst, size_t size,
+        const char *file_path, const struct stat *st, int gzip)
+{
+    char etag[64], date[64];
 
-    // Note: since the URI definitely begins with '/', we don't need to worry
-    // about appending '/' to web_root.
+    make_etag(etag, sizeof(etag), st, gzip);
+    format_http_date(date, sizeof(date), st->st_mtime);
 
-    strcat(file_path, request_uri);
+    int n = snprintf(dst, size, "ETag: %s\r\nLast-Modified: %s\r\n", etag, date);
 
-    // If request_uri ends with '/', append "index.html".
-    if (file_path[strlen(file_path) - 1] == '/')
-        strcat(file_path, "index.html");
+    const struct cache_rule *r = find_cache_rule(srv, file_path);
+    if (r && n >= 0 && (size_t)n < size)
+        n += snprintf(dst + n, size - n, "Cache-Control: max-age=%ld\r\n", r->max_age);
 
-    /*
-     * Open the requested file.
-     */
+    return n < 0 ? 0 : (size_t)n < size ? n : (int)size - 1;
+}
 
-    // See if the requested file is a directory.
-    struct stat st;
-    if (stat(file_path, &st) == 0 && S_ISDIR(st.st_mode)) {
-        status_code = 301; // "Moved Permanently"
-        if (send301(request_uri, clnt_w) < 0)
-            perror("send");
-        goto cleanup;
-    }
+/*
+ * Returns nonzero if the If-None-Match value (len bytes at list) matches
+ * etag. GET uses the weak comparison, so W/ prefixes don't matter.
+ */
+static int etag_matches(const char *list, size_t len, const char *etag)
+{
+    size_t etag_len = strlen(etag);
+    const char *end = list + len;
 
-    // If unable to open the file, send "404 Not Found".
-    fp = fopen(file_path, "rb");
-    if (fp == NULL) {
-        status_code = 404; // "Not Found"
-        if (send_error_status(clnt_w, status_code) < 0)
-            perror("send");
-      goto cleanup;
-    }
+    while (list < end) {
+        while (list < end && (*list == ',' || *list == ' ' || *list == '\t'))
+            list++;
+        if (list == end)
+            break;
+        if (*list == '*')
+            return 1;
+        if (end - list >= 2 && list[0] == 'W' && list[1] == '/')
+            list += 2;
+
+        const char *tag_end = list;
+        if (tag_end < end && *tag_end == '"') {
+            tag_end = memchr(tag_end + 1, '"', end - tag_end - 1);
+            if (tag_end == NULL)
+                return 0;
+            tag_end++;
+        }
+        else {
+            while (tag_end < end && *tag_end != ',')
+                tag_end++;
+        }
 
-    // Otherwise, send "200 OK".
-    status_code = 200; // "OK"
-    if (send_status_line(clnt_w, status_code) < 0 || send_blank_line(clnt_w) < 0) {
-        perror("send");
-        goto cleanup;
+        if ((size_t)(tag_end - list) == etag_len && memcmp(list, etag, etag_len) == 0)
+            return 1;
+        list = tag_end;
     }
+    return 0;
+}
 
-    /*
-     * Send the file.
-     */
-
-    // Buffer for file contents.
-    char file_buf[DISK_IO_BUF_SIZE];
-
-    // Turn off buffering for clnt_w because we already have our own file_buf.
-    if (fflush(clnt_w) < 0) {
-        perror("send");
-        goto cleanup;
+/*
+ * Returns nonzero if the request shows that the client's copy of the file
+ * whose stat() result is st is current.
+ */
+static int not_modified(struct conn *c, const struct stat *st, int gzip)
+{
+    const struct http_slice *inm = http_find_header(&c->parser, "If-None-Match");
+    if (inm) {
+        char etag[64];
+        make_etag(etag, sizeof(etag), st, gzip);
+        return etag_matches(inm->p, inm->len, etag);
     }
-    setbuf(clnt_w, NULL);
 
-    // Read and send file in a block at a time.
-    size_t n;
-    while ((n = fread(file_buf, 1, sizeof(file_buf), fp)) > 0) {
-        if (fwrite(file_buf, 1, n, clnt_w) != n) {
-            perror("send");
-            goto cleanup;
+    // Dates in any other format, or in the future, are ignored.
+    const struct http_slice *ims = http_find_header(&c->parser, "If-Modified-Since");
+    if (ims && ims->len < 64) {
+        char date[64];
+        memcpy(date, ims->p, ims->len);
+        date[ims->len] = '\0';
+
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end && *end == '\0') {
+            time_t t = timegm(&tm);
+            return t <= time(NULL) && st->st_mtime <= t;
         }
     }
+    return 0;
+}
 
-    // fread() returns 0 both on EOF and on error; check if there was an error.
-    if (ferror(fp))
-        // Note that if we had an error, we sent the client a truncated (i.e.,
-        // corrupted) file; not much we can do about that at this point since
-        // we already sent the status...
-        perror("fread");
+/*
+ * If the client's copy of the file at file_path (whose stat() result is st)
+ * is current, queue a 304 response and return nonzero.
+ */
+static int send_if_not_modified(struct conn *c, const char *file_path,
+        const struct stat *st, int gzip)
+{
+    if (!not_modified(c, st, gzip))
+        return 0;
 
-cleanup:
+    char hdr[512];
+    int hdr_len = format_validators(c->srv, hdr, sizeof(hdr), file_path, st, gzip);
 
-    /*
-     * close() the FILE pointer and return.
-     */
+    send_status_line(c, 304);
+    buf_append(&c->out, hdr, hdr_len);
+    send_vary(c);
+    send_end_of_headers(c);
+    return 1;
+}
+
+/*
+ * Byte ranges.
+ *
+ * A Range request for a plain (not gzip-encoded) file gets just the bytes
+ * asked for: one range as the body of a 206, several as the parts of a
+ * multipart/byteranges body. Either way each range is sent from where the
+ * file already is, the file cache or the page cache, like a whole file.
+ * Requests for more than MAX_RANGES ranges, or for more bytes than the file
+ * holds (overlapping ranges), get the whole file instead.
+ */
 
-    if (fp)
-        fclose(fp);
+static long long now_us(void);
+
+/*
+ * Parse the number at *p, moving *p past it.
+ *
+ * Returns negative if there is none or it overflows.
+ */
+static long long parse_number(const char **p, const char *end)
+{
+    long long n = 0;
+    const char *start = *p;
 
-    return status_code;
+    for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+        if (n > (LLONG_MAX - (**p - '0')) / 10)
+            return -1;
+        n = n * 10 + (**p - '0');
+    }
+    return *p > start ? n : -1;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Parse the Range header value (len bytes at spec) against a file of size
+ * bytes into ranges, which has room for MAX_RANGES.
+ *
+ * Returns the number of satisfiable ranges, or negative if the header is to
+ * be ignored.
+ */
+static int parse_ranges(const char *spec, size_t len, off_t size, struct byte_range *ranges)
 {
-    /*
-     * Configure signal-handling.
-     */
+    const char *p = spec, *end = spec + len;
+    int n = 0, nspecs = 0;
+    off_t total = 0;
 
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
+    if (len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+        return -1;
+    p += 6;
 
-    // Ignore SIGPIPE so that we don't terminate when we call
-    // send() on a disconnected socket.
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sa.sa_handler = SIG_IGN;
-    if (sigaction(SIGPIPE, &sa, NULL))
-        die("sigaction(SIGPIPE)");
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p == end)
+            break;
 
-    /*
-     * Parse arguments.
-     */
+        // first-last, first-, or -suffix_length
+        long long first = -1, last = -1;
+        if (*p != '-' && (first = parse_number(&p, end)) < 0)
+            return -1;
+        if (p == end || *p++ != '-')
+            return -1;
+        if (p < end && *p >= '0' && *p <= '9' && (last = parse_number(&p, end)) < 0)
+            return -1;
+        if ((first < 0 && last < 0) || (first >= 0 && last >= 0 && last < first))
+            return -1;
+        if (++nspecs > MAX_RANGES)
+            return -1;
+
+        off_t start, stop;
+        if (first < 0) {
+            if (last == 0 || size == 0)
+                continue; // unsatisfiable
+            start = last >= size ? 0 : size - last;
+            stop = size;
+        }
+        else {
+            if (first >= size)
+                continue; // unsatisfiable
+            start = first;
+            stop = last < 0 || last >= size ? size : last + 1;
+        }
 
-    if (argc != 5) {
-        fprintf(stderr, "usage: %s <http-port> <web-root> <mdb-host> <mdb-port>\n", argv[0]);
-        exit(1);
-    }
-    char *http_port = argv[1];
-    char *web_root = argv[2];
-    //char *mdb_host = argv[3];
-    char *mdb_port = argv[4];
+        total += stop - start;
+        if (total > size)
+            return -1;
+        ranges[n++] = (struct byte_range){ start, stop, 0, 0 };
 
-    // Construct mdb-lookup socket here
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < end && *p != ',')
+            return -1;
+    }
+    return n;
+}
 
-    struct addrinfo mdb_hints, *mdb_info;
+/*
+ * Returns nonzero unless an If-Range header says the client's partial copy
+ * is of a different version of the file whose stat() result is st.
+ */
+static int if_range_matches(struct conn *c, const struct stat *st)
+{
+    const struct http_slice *ir = http_find_header(&c->parser, "If-Range");
+    if (ir == NULL)
+        return 1;
+
+    // An entity tag must match exactly (strong comparison), a date must be
+    // the Last-Modified we'd send.
+    char validator[64];
+    if (ir->len && ir->p[0] == '"')
+        make_etag(validator, sizeof(validator), st, 0);
+    else
+        format_http_date(validator, sizeof(validator), st->st_mtime);
+    return http_slice_eq(*ir, validator);
+}
 
-    memset(&mdb_hints, 0, sizeof(mdb_hints));
-    mdb_hints.ai_family = AF_INET;       // Only accept IPv4 addresses
-    mdb_hints.ai_socktype = SOCK_STREAM; // stream socket for TCP connections
-    mdb_hints.ai_protocol = IPPROTO_TCP; // TCP protocol
-    mdb_hints.ai_flags = AI_PASSIVE;     // Construct socket address for bind()ing
+/*
+ * Queue part r of a multipart response behind whatever is in out already.
+ */
+static void queue_range(struct conn *c, const struct byte_range *r)
+{
+    if (r->hdr_len)
+        buf_append(&c->out, c->body.data + r->hdr_off, r->hdr_len);
+    if (c->range_data) {
+        c->data = c->range_data + r->start;
+        c->data_len = r->end - r->start;
+    } else {
+        c->file_off = r->start;
+        c->file_end = r->end;
+    }
+}
 
-    int mdb_addr_err;
-    if ((mdb_addr_err = getaddrinfo(NULL, mdb_port, &mdb_hints, &mdb_info)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(mdb_addr_err));
-        exit(1);
-    }   
+/*
+ * Answer a Range request for the file at file_path (whose stat() result is
+ * st) with just the bytes asked for, sent from the cached response e if not
+ * NULL, or else from fd.
+ *
+ * Returns the status code of the queued response, or 0 if the whole file
+ * should be sent instead. If a response is queued, it owns fd.
+ */
+static int send_ranges(struct conn *c, const char *file_path, const struct stat *st,
+        struct file_cache_entry *e, int fd)
+{
+    const struct http_slice *range = http_find_header(&c->parser, "Range");
+    if (range == NULL || !S_ISREG(st->st_mode) || !if_range_matches(c, st))
+        return 0;
+
+    struct byte_range ranges[MAX_RANGES + 1];
+    int n = parse_ranges(range->p, range->len, st->st_size, ranges);
+    if (n < 0)
+        return 0;
+
+    if (n == 0) {
+        if (fd >= 0)
+            close(fd);
+        buf_printf(&c->body, "<html><body>\n<h1>416 %s</h1>\n</body></html>\n",
+                get_reason_phrase(416));
+        send_status_line(c, 416);
+        buf_printf(&c->out, "Content-Range: bytes */%lld\r\n", (long long)st->st_size);
+        send_body(c);
+        return 416; // "Range Not Satisfiable"
+    }
 
-    int mdb_fd = socket(mdb_info->ai_family, mdb_info->ai_socktype, mdb_info->ai_protocol);
-    if (mdb_fd < 0)
-        die("socket");
+    // Several ranges are parts of a multipart body, each with its own
+    // headers, and a closing delimiter as a last part without any bytes.
+    if (n > 1 && (c->ranges = malloc((n + 1) * sizeof(*c->ranges))) == NULL)
+        return 0;
+
+    char validators[512];
+    int validators_len = format_validators(c->srv, validators, sizeof(validators),
+            file_path, st, 0);
+
+    send_status_line(c, 206);
+    buf_append(&c->out, validators, validators_len);
+    buf_printf(&c->out, "Accept-Ranges: bytes\r\n");
+    send_vary(c);
+
+    if (n == 1) {
+        buf_printf(&c->out, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                (long long)ranges[0].start, (long long)ranges[0].end - 1,
+                (long long)st->st_size);
+        buf_printf(&c->out, "Content-Length: %lld\r\n",
+                (long long)(ranges[0].end - ranges[0].start));
+    }
+    else {
+        char boundary[40];
+        snprintf(boundary, sizeof(boundary), "%016llx%08x",
+                (unsigned long long)now_us() ^ (unsigned long long)st->st_ino,
+                (unsigned)c->nrequests);
+
+        off_t total = 0;
+        for (int i = 0; i <= n; i++) {
+            ranges[i].hdr_off = c->body.len;
+            if (i < n)
+                buf_printf(&c->body, "\r\n--%s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                        boundary, (long long)ranges[i].start, (long long)ranges[i].end - 1,
+                        (long long)st->st_size);
+            else
+                buf_printf(&c->body, "\r\n--%s--\r\n", boundary);
+            ranges[i].hdr_len = c->body.len - ranges[i].hdr_off;
+            if (i == n)
+                ranges[i].start = ranges[i].end = 0;
+            total += ranges[i].hdr_len + ranges[i].end - ranges[i].start;
+        }
 
-    if (connect(mdb_fd, mdb_info->ai_addr, mdb_info->ai_addrlen) < 0)
-        die("connect");
+        buf_printf(&c->out, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+        buf_printf(&c->out, "Content-Length: %lld\r\n", (long long)total);
+        memcpy(c->ranges, ranges, (n + 1) * sizeof(*c->ranges));
+        c->nranges = n + 1;
+    }
+    send_end_of_headers(c);
+
+    if (e) {
+        file_cache_hold(e);
+        c->file_ref = e;
+        c->range_data = e->data + e->hdr_len;
+    } else {
+        c->file_fd = fd;
+    }
 
-    freeaddrinfo(mdb_info);
-    
-    // Wrap persistent socket connection in FILE pointers for reading and
-    // writing
-    FILE *mdb_fpr = fdopen(mdb_fd, "r");
-    if(mdb_fpr == NULL)
-        die("fdopen");
+    if (n == 1)
+        queue_range(c, &ranges[0]); // no part headers
+    else
+        queue_range(c, &c->ranges[c->next_range++]);
+    return 206; // "Partial Content"
+}
 
-    FILE *mdb_fpw = fdopen(mdb_fd, "w");
-    if(mdb_fpw == NULL)
-        die("fdopen");
+/*
+ * Queue the response cached in e for the file at file_path, or a 304 if the
+ * client has it already.
+ *
+ * Returns the status code of the response.
+ */
+static int send_entry(struct conn *c, const char *file_path, struct file_cache_entry *e,
+        int gzip)
+{
+    if (send_if_not_modified(c, file_path, &e->st, gzip))
+        return 304; // "Not Modified"
 
-    /*
-     * Construct server socket to listen on serv_port.
-     */
+    int status_code;
+    if (!gzip && (status_code = send_ranges(c, file_path, &e->st, e, -1)))
+        return status_code;
+
+    buf_append(&c->out, e->data, e->hdr_len);
+    send_vary(c);
+    send_end_of_headers(c);
+    file_cache_hold(e);
+    c->file_ref = e;
+    c->data = e->data + e->hdr_len;
+    c->data_len = e->len - e->hdr_len;
+    return 200; // "OK"
+}
 
-    struct addrinfo hints, *info;
+/*
+ * gzip content encoding.
+ *
+ * A client that accepts gzip gets file.gz in place of file if it exists and
+ * is at least as new as file; failing that, text files are compressed on
+ * their first request. Either way the compressed response is cached in
+ * srv->gzips under the path of file itself, so inotify drops it when either
+ * file changes. A file with neither is cached there as an entry without
+ * headers, which sends us straight to the plain response next time.
+ */
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;       // Only accept IPv4 addresses
-    hints.ai_socktype = SOCK_STREAM; // stream socket for TCP connections
-    hints.ai_protocol = IPPROTO_TCP; // TCP protocol
-    hints.ai_flags = AI_PASSIVE;     // Construct socket address for bind()ing
+static const char *compressible_suffixes[] = {
+    ".html", ".htm", ".css", ".js", ".json", ".txt", ".xml", ".svg", ".csv", ".md",
+    NULL // marks the end of the list
+};
 
-    int addr_err;
-    if ((addr_err = getaddrinfo(NULL, http_port, &hints, &info)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(addr_err));
-        exit(1);
+static int is_compressible(const char *path)
+{
+    size_t len = strlen(path);
+    for (int i = 0; compressible_suffixes[i]; i++) {
+        size_t n = strlen(compressible_suffixes[i]);
+        if (len > n && strcasecmp(path + len - n, compressible_suffixes[i]) == 0)
+            return 1;
     }
+    return 0;
+}
 
-    int serv_fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
-    if (serv_fd < 0)
-        die("socket");
+/*
+ * Read size bytes from the start of fd into a malloc'ed buffer.
+ *
+ * Returns NULL if failed.
+ */
+static char *read_file(int fd, size_t size)
+{
+    char *data = malloc(size ? size : 1);
+    if (data == NULL)
+        return NULL;
+
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, data + got, size - got, got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        got += n;
+    }
+    return data;
+}
+
+/*
+ * Compress len bytes at in into a malloc'ed gzip stream, whose length is
+ * stored in *out_len.
+ *
+ * Returns NULL if failed.
+ */
+static char *gzip_compress(const char *in, size_t len, size_t *out_len)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    // 16 + 15: a gzip header and trailer around a deflate stream with the
+    // largest window.
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + 15, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    size_t cap = deflateBound(&zs, len);
+    char *out = malloc(cap);
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = cap;
+
+    int rc = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static int newer_or_same(const struct stat *a, const struct stat *b)
+{
+    return a->st_mtim.tv_sec > b->st_mtim.tv_sec
+        || (a->st_mtim.tv_sec == b->st_mtim.tv_sec
+            && a->st_mtim.tv_nsec >= b->st_mtim.tv_nsec);
+}
+
+/*
+ * Try to answer c with the gzip-encoded contents of file_path.
+ *
+ * Returns the status code if the response is queued, or 0 if the plain file
+ * should be sent instead (including when file_path can't be opened; the plain
+ * path reports that).
+ */
+static int handle_gzip_request(struct conn *c, const char *file_path)
+{
+    struct file_cache *gz = &c->srv->gzips;
+    struct file_cache_entry *e = file_cache_lookup(gz, file_path);
+
+    if (e) {
+        if (e->hdr_len == 0)
+            return 0; // nothing better than the plain file
+        return send_entry(c, file_path, e, 1);
+    }
+
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+
+    char gz_path[PATH_MAX];
+    char hdr[512];
+    int gz_fd = -1;
+    struct stat gz_st;
+
+    if (snprintf(gz_path, sizeof(gz_path), "%s.gz", file_path) < (int)sizeof(gz_path))
+        gz_fd = open(gz_path, O_RDONLY | O_CLOEXEC);
+
+    if (gz_fd >= 0 && fstat(gz_fd, &gz_st) == 0 && S_ISREG(gz_st.st_mode)
+            && newer_or_same(&gz_st, &st)) {
+        close(fd);
+
+        int hdr_len = snprintf(hdr, sizeof(hdr),
+                "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\nContent-Encoding: gzip\r\n",
+                (long long)gz_st.st_size);
+        hdr_len += format_validators(c->srv, hdr + hdr_len, sizeof(hdr) - hdr_len,
+                file_path, &st, 1);
+
+        char *data = NULL;
+        if ((size_t)gz_st.st_size <= gz->max_file_size
+                && (data = read_file(gz_fd, gz_st.st_size)) != NULL) {
+            e = file_cache_insert_data(gz, file_path, &st, hdr, hdr_len, data, gz_st.st_size);
+            free(data);
+            if (e) {
+                close(gz_fd);
+                return send_entry(c, file_path, e, 1);
+            }
+        }
+
+        if (send_if_not_modified(c, file_path, &st, 1)) {
+            close(gz_fd);
+            return 304; // "Not Modified"
+        }
+
+        // Too big to keep in memory; send it from the disk.
+        buf_append(&c->out, hdr, hdr_len);
+        send_vary(c);
+        send_end_of_headers(c);
+        c->file_fd = gz_fd;
+        c->file_off = 0;
+        c->file_end = gz_st.st_size;
+        return 200; // "OK"
+    }
+
+    if (gz_fd >= 0)
+        close(gz_fd);
+
+    if (is_compressible(file_path) && st.st_size >= GZIP_MIN_SIZE
+            && (size_t)st.st_size <= gz->max_file_size) {
+        char *data = read_file(fd, st.st_size);
+        size_t gz_len;
+        char *gz_data = data ? gzip_compress(data, st.st_size, &gz_len) : NULL;
+        free(data);
+
+        if (gz_data && gz_len < (size_t)st.st_size) {
+            int hdr_len = snprintf(hdr, sizeof(hdr),
+                    "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Encoding: gzip\r\n",
+                    gz_len);
+            hdr_len += format_validators(c->srv, hdr + hdr_len, sizeof(hdr) - hdr_len,
+                    file_path, &st, 1);
+            e = file_cache_insert_data(gz, file_path, &st, hdr, hdr_len, gz_data, gz_len);
+            free(gz_data);
+            close(fd);
+            if (e == NULL)
+                return 0;
+            return send_entry(c, file_path, e, 1);
+        }
+        free(gz_data);
+    }
+
+    // Remember that there is nothing to gain here.
+    close(fd);
+    file_cache_insert_data(gz, file_path, &st, "", 0, "", 0);
+    return 0;
+}
+
+/*
+ * Handle static file requests.
+ * Returns the HTTP status code of the response queued on c.
+ *
+ * On success the file is left open in c->file_fd for conn_write() to send.
+ */
+static int handle_file_request(const char *web_root, const char *request_uri,
+        struct conn *c)
+{
+    /*
+     * Construct the path of the requested file from web_root and request_uri.
+     */
+
+    char file_path[PATH_MAX];
+
+    if (strlen(web_root) + strlen(request_uri) + 12 > sizeof(file_path)) {
+        // File paths can't exceed sizeof(file_path) on Linux, so just 404.
+        send_error_status(c, 404); // "Not Found"
+        return 404;
+    }
+
+    strcpy(file_path, web_root);
+
+    // Note: since the URI definitely begins with '/', we don't need to worry
+    // about appending '/' to web_root.
+
+    strcat(file_path, request_uri);
+
+    // If request_uri ends with '/', append "index.html".
+    if (file_path[strlen(file_path) - 1] == '/')
+        strcat(file_path, "index.html");
+
+    /*
+     * Send it compressed if the client takes that, unless it wants byte
+     * ranges, which we only serve of the plain file.
+     */
+
+    if (c->accept_gzip && c->srv->gzips.lru.max_bytes
+            && !http_find_header(&c->parser, "Range")) {
+        int status_code = handle_gzip_request(c, file_path);
+        if (status_code)
+            return status_code;
+    }
+
+    /*
+     * Serve the file from the cache if we can.
+     */
+
+    struct file_cache *fc = &c->srv->files;
+    struct file_cache_entry *e;
+
+    if (fc->lru.max_bytes && (e = file_cache_lookup(fc, file_path)) != NULL)
+        return send_entry(c, file_path, e, 0);
+
+    /*
+     * Open the requested file.
+     */
+
+    // If unable to open the file, send "404 Not Found".
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        send_error_status(c, 404); // "Not Found"
+        return 404;
+    }
+
+    // See if the requested file is a directory.
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        send_error_status(c, 404); // "Not Found"
+        return 404;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        close(fd);
+        send301(request_uri, c);
+        return 301; // "Moved Permanently"
+    }
+
+    if (send_if_not_modified(c, file_path, &st, 0)) {
+        close(fd);
+        return 304; // "Not Modified"
+    }
+
+    int status_code = send_ranges(c, file_path, &st, NULL, fd);
+    if (status_code)
+        return status_code;
+
+    // Otherwise, send "200 OK" followed by the file.
+    char validators[512];
+    int validators_len = format_validators(c->srv, validators, sizeof(validators),
+            file_path, &st, 0);
+
+    size_t hdr_start = c->out.len;
+    send_status_line(c, 200);
+    buf_printf(&c->out, "Content-Length: %lld\r\n", (long long)st.st_size);
+    buf_printf(&c->out, "Accept-Ranges: bytes\r\n");
+    buf_append(&c->out, validators, validators_len);
+
+    // Small files are read into the cache and sent from there; the next
+    // request for them won't touch the file system at all.
+    if (fc->lru.max_bytes) {
+        e = file_cache_insert(fc, file_path, fd, &st,
+                c->out.data + hdr_start, c->out.len - hdr_start);
+        if (e) {
+            close(fd);
+            send_vary(c);
+            send_end_of_headers(c);
+            file_cache_hold(e);
+            c->file_ref = e;
+            c->data = e->data + e->hdr_len;
+            c->data_len = e->len - e->hdr_len;
+            return 200; // "OK"
+        }
+    }
+
+    send_vary(c);
+    send_end_of_headers(c);
+
+    c->file_fd = fd;
+    c->file_off = 0;
+    c->file_end = st.st_size;
+
+    return 200; // "OK"
+}
+
+/*
+ * Connection lifecycle.
+ */
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void conn_start_reading(struct conn *c)
+{
+    struct server *srv = c->srv;
+
+    c->state = CONN_READING;
+
+    // A new connection owes us a request right away; a persistent one may
+    // sit idle for a while first, unless the next request is already here.
+    int timeout = c->nrequests > 0 && c->req_len == 0
+        ? srv->keepalive_timeout : srv->header_timeout;
+    timer_arm(&srv->timers, &c->timer, now_ms() + timeout * 1000LL);
+}
+
+static void conn_stop_reading(struct conn *c)
+{
+    timer_cancel(&c->srv->timers, &c->timer);
+}
+
+/*
+ * The socket won't take any more of the response for now; give the client
+ * write_timeout seconds to make room.
+ */
+static void conn_wait_writable(struct conn *c)
+{
+    struct server *srv = c->srv;
+
+    timer_arm(&srv->timers, &c->timer, now_ms() + srv->write_timeout * 1000LL);
+}
+
+/*
+ * Queue the access log line for c's request; the log writer thread writes it
+ * out later (see access-log.h).
+ */
+static void conn_log(struct conn *c)
+{
+    struct server *srv = c->srv;
+
+    if (srv->nlogged++ % srv->log_sample)
+        return;
+
+    char line[LOG_LINE_MAX];
+    int n = snprintf(line, sizeof(line), "%s \"%s %s %s\" %d %s\n",
+        c->clnt_ip,
+        c->method ? c->method : "-",
+        c->request_uri ? c->request_uri : "-",
+        c->http_version ? c->http_version : "-",
+        c->status_code,
+        get_reason_phrase(c->status_code));
+    if (n < 0)
+        return;
+    if (n >= (int)sizeof(line)) {
+        // Cut at the end of the buffer, but keep the line a line.
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+
+    if (log_ring_put(&srv->log, line, n) < 0)
+        metrics_add(&srv->metrics.log_dropped, 1);
+}
+
+static void conn_close(struct conn *c)
+{
+    timer_cancel(&c->srv->timers, &c->timer);
+
+    if (c->file_fd >= 0)
+        close(c->file_fd);
+    close(c->fd);
+    c->fd = -1;
+
+    // The connection may still show up in events from this epoll_wait()
+    // round, so we free it only after the round is over.
+    c->next = c->srv->closed;
+    c->srv->closed = c;
+}
+
+static void conn_free(struct conn *c)
+{
+    c->srv->nconns--;
+    metrics_gauge_add(&c->srv->metrics.open_conns, -1);
+    release_data(c);
+    buf_free(&c->body);
+    buf_free(&c->out);
+    free(c);
+}
+
+/*
+ * The response has been sent: log the request, then either close the
+ * connection or get it ready for the next request.
+ */
+static void conn_finish(struct conn *c)
+{
+    struct metrics *m = &c->srv->metrics;
+
+    conn_log(c);
+
+    metrics_add(&m->requests[c->route], 1);
+    if (c->status_code > 0 && c->status_code < 600)
+        metrics_add(&m->status[c->status_code], 1);
+    if (c->started_us)
+        metrics_observe(&m->latency[c->route], now_us() - c->started_us);
+
+    // The next response on this connection would be read as the rest of
+    // this one unless all of this one went out.
+    int complete = c->out_sent == c->out.len + c->data_len
+        && (c->file_fd < 0 || c->file_off == c->file_end)
+        && c->next_range >= c->nranges;
+    if (!complete) {
+        fprintf(stderr, "%s: response cut short; closing the connection\n", c->clnt_ip);
+        c->keep_alive = 0;
+    }
+
+    if (c->file_fd >= 0) {
+        close(c->file_fd);
+        c->file_fd = -1;
+    }
+
+    if (!c->keep_alive) {
+        // Drain whatever the client sent after the request so that close()
+        // doesn't reset the connection before the response arrives.
+        while (recv(c->fd, c->srv->io_buf, sizeof(c->srv->io_buf), 0) > 0)
+            ;
+        conn_close(c);
+        return;
+    }
+
+    // Keep any pipelined requests that arrived behind this one.
+    c->req_len -= c->req_end;
+    memmove(c->req, c->req + c->req_end, c->req_len);
+    c->req[c->req_len] = '\0';
+    c->req_end = 0;
+    http_parser_init(&c->parser, MAX_REQUEST_SIZE);
+
+    c->method = c->request_uri = c->http_version = NULL;
+    c->status_code = 0;
+    c->route = ROUTE_OTHER;
+    c->started_us = 0;
+    c->body.len = 0;
+    c->out.len = c->out_sent = 0;
+    release_data(c);
+    c->no_sendfile = 0;
+
+    conn_start_reading(c);
+
+    // Pick up the next request after this round of events rather than right
+    // here, so that a long pipeline doesn't turn into deep recursion.
+    if (!c->on_ready) {
+        c->on_ready = 1;
+        c->ready_next = c->srv->ready;
+        c->srv->ready = c;
+    }
+}
+
+/*
+ * Send as much of the response as the socket will take; finish the request
+ * when the response is complete.
+ */
+static void conn_write(struct conn *c)
+{
+    for (;;) {
+        // If a file or another part follows, MSG_MORE holds the headers back so
+        // that they go out in the same segment as what follows them.
+        int more = (c->file_fd >= 0 && c->file_off < c->file_end)
+            || c->next_range < c->nranges ? MSG_MORE : 0;
+
+        // Send the headers and the body together.
+        while (c->out_sent < c->out.len + c->data_len) {
+            struct iovec iov[2];
+            struct msghdr msg = { .msg_iov = iov };
+
+            if (c->out_sent < c->out.len) {
+                iov[0].iov_base = c->out.data + c->out_sent;
+                iov[0].iov_len = c->out.len - c->out_sent;
+                iov[1].iov_base = (char *)c->data;
+                iov[1].iov_len = c->data_len;
+                msg.msg_iovlen = c->data_len ? 2 : 1;
+            } else {
+                size_t off = c->out_sent - c->out.len;
+                iov[0].iov_base = (char *)c->data + off;
+                iov[0].iov_len = c->data_len - off;
+                msg.msg_iovlen = 1;
+            }
+
+            // sendmsg() is writev() with flags.
+            ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | more);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    conn_wait_writable(c);
+                    return; // wait for EPOLLOUT
+                }
+                perror("send");
+                conn_close(c);
+                return;
+            }
+            c->out_sent += n;
+            metrics_add(&c->srv->metrics.bytes_sent, n);
+        }
+
+        // Send the file straight from the page cache to the socket.
+        while (c->file_fd >= 0 && c->file_off < c->file_end && !c->no_sendfile) {
+            ssize_t n = sendfile(c->fd, c->file_fd, &c->file_off, c->file_end - c->file_off);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    conn_wait_writable(c);
+                    return; // wait for EPOLLOUT
+                }
+                if (errno == EINVAL || errno == ENOSYS) {
+                    // The file doesn't support sendfile(); copy it ourselves.
+                    c->no_sendfile = 1;
+                    break;
+                }
+                perror("sendfile");
+                conn_close(c);
+                return;
+            }
+            if (n == 0) {
+                // The file shrank underneath us, and we can't make up the
+                // Content-Length we promised; closing tells the client.
+                fprintf(stderr, "sendfile: file truncated\n");
+                conn_close(c);
+                return;
+            }
+            metrics_add(&c->srv->metrics.bytes_sent, n);
+        }
+
+        // Otherwise, read and send file in a block at a time.
+        while (c->file_fd >= 0 && c->file_off < c->file_end && c->no_sendfile) {
+            size_t want = sizeof(c->srv->io_buf);
+            if ((off_t)want > c->file_end - c->file_off)
+                want = c->file_end - c->file_off;
+
+            ssize_t r = pread(c->file_fd, c->srv->io_buf, want, c->file_off);
+            if (r <= 0) {
+                // We already sent the status, so all we can do is close the
+                // connection, so that the client knows the file is truncated.
+                if (r < 0)
+                    perror("pread");
+                else
+                    fprintf(stderr, "pread: file truncated\n");
+                conn_close(c);
+                return;
+            }
+
+            ssize_t n = send(c->fd, c->srv->io_buf, r, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    conn_wait_writable(c);
+                    return; // wait for EPOLLOUT
+                }
+                perror("send");
+                conn_close(c);
+                return;
+            }
+            // Anything not taken by send() is simply read again next time.
+            c->file_off += n;
+            metrics_add(&c->srv->metrics.bytes_sent, n);
+        }
+
+        // On to the next part of a multipart response, if any.
+        if (c->next_range >= c->nranges)
+            break;
+        c->out.len = c->out_sent = 0;
+        c->data = NULL;
+        c->data_len = 0;
+        queue_range(c, &c->ranges[c->next_range++]);
+    }
+
+    conn_finish(c);
+}
+
+static void conn_respond(struct conn *c, int status_code)
+{
+    conn_stop_reading(c);
+    c->status_code = status_code;
+    c->state = CONN_WRITING;
+    conn_write(c);
+}
+
+/*
+ * mdb-lookup backend.
+ */
+
+static void backend_fail(struct backend *be);
+
+/*
+ * Start connecting be to mdb-lookup-server.
+ *
+ * Returns negative if failed.
+ */
+static int backend_connect(struct backend *be)
+{
+    struct server *srv = be->srv;
+
+    int fd = socket(srv->mdb_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            IPPROTO_TCP);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Have TCP probe the connection while it sits idle, so that we notice a
+    // backend host that went away before we hand it a lookup.
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+    // A non-blocking connect() completes in the background; we find out how
+    // it went when the socket becomes writable.
+    if (connect(fd, (struct sockaddr *)&srv->mdb_addr, srv->mdb_addr_len) < 0
+            && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = be };
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(fd);
+        return -1;
+    }
+
+    be->fd = fd;
+    be->connected = 0;
+    be->ready = 0;
+    be->out.len = be->out_sent = 0;
+    be->in_len = 0;
+    be->rows = 0;
+    be->in_answer = 0;
+
+    // The handshake goes out once we're connected. In binary, it's saying
+    // that we speak binary.
+    if (srv->binary_backend)
+        buf_append(&be->out, MDB_PROTO_MAGIC, MDB_PROTO_MAGIC_LEN);
+    else
+        buf_append(&be->out, BACKEND_PROBE "\n", sizeof(BACKEND_PROBE));
+
+    // A server that accepts but never answers would otherwise hold the
+    // connection out of the pool for good.
+    timer_arm(&srv->timers, &be->retry, now_ms() + srv->backend_timeout * 1000LL);
+    return 0;
+}
+
+static void backend_flush(struct backend *be)
+{
+    while (be->connected && be->out_sent < be->out.len) {
+        ssize_t n = send(be->fd, be->out.data + be->out_sent,
+                be->out.len - be->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // wait for EPOLLOUT
+            perror("send");
+            backend_fail(be);
+            return;
+        }
+        be->out_sent += n;
+    }
+
+    if (be->out_sent == be->out.len)
+        be->out.len = be->out_sent = 0;
+}
+
+/*
+ * Answer every connection waiting for lk, with its result if status_code is
+ * 200 and with an error otherwise, then free lk.
+ */
+static void lookup_finish(struct server *srv, struct lookup *lk, int status_code)
+{
+    srv->nlookups--;
+    timer_cancel(&srv->timers, &lk->timer);
+    if (lk->lru.key)
+        lru_remove(&srv->inflight, &lk->lru);
+
+    // Cached results may now be missing the new record.
+    if (lk->add && status_code == 200)
+        lookup_cache_invalidate_all();
+
+    // Every waiter sends the page straight from the cache entry if there is
+    // one; otherwise each needs its own copy, since lk is about to go.
+    struct lookup_cache_entry *e = NULL;
+    if (status_code == 200 && !lk->add && srv->lookups.lru.max_bytes)
+        e = lookup_cache_put(&srv->lookups, lk->key, lk->generation,
+                lk->body.data, lk->body.len);
+
+    struct conn *c = lk->waiters;
+    while (c) {
+        struct conn *next = c->next;
+        if (status_code == 200 && e) {
+            send_status_line(c, 200);
+            send_data(c, e->data, e->len);
+            lookup_cache_hold(e);
+            c->lookup_ref = e;
+        } else if (status_code == 200) {
+            buf_append(&c->body, lk->body.data, lk->body.len);
+            send_status_line(c, 200);
+            send_body(c);
+        } else {
+            send_error_status(c, status_code);
+        }
+        conn_respond(c, status_code);
+        c = next;
+    }
+
+    buf_free(&lk->body);
+    free(lk);
+}
+
+/*
+ * The in-flight table doesn't own its lookups; they are freed by
+ * lookup_finish().
+ */
+static void forget_lookup(struct lru_entry *e)
+{
+}
+
+/*
+ * Answer every lookup still waiting for a backend connection with
+ * status_code.
+ */
+static void backend_reject_pending(struct server *srv, int status_code)
+{
+    struct lookup *lk = srv->pending_head;
+    srv->pending_head = srv->pending_tail = NULL;
+
+    while (lk) {
+        struct lookup *next = lk->next;
+        lookup_finish(srv, lk, status_code);
+        lk = next;
+    }
+}
+
+/*
+ * lk has gone backend_timeout seconds without an answer. Answers come in
+ * order, so its connection is stuck; drop it along with everything else in
+ * flight on it.
+ *
+ * If lk hasn't been sent, no connection has had room for it all that time;
+ * take it off the pending list and turn its clients away.
+ */
+static void lookup_timeout(void *arg)
+{
+    struct lookup *lk = arg;
+    struct server *srv = lk->srv;
+
+    fprintf(stderr, "mdb lookup: timed out\n");
+    if (lk->be) {
+        backend_fail(lk->be);
+        return;
+    }
+
+    struct lookup **p = &srv->pending_head, *prev = NULL;
+    while (*p != lk) {
+        prev = *p;
+        p = &prev->next;
+    }
+    *p = lk->next;
+    if (srv->pending_tail == lk)
+        srv->pending_tail = prev;
+
+    lookup_finish(srv, lk, 503); // "Service Unavailable"
+}
+
+/*
+ * Send lk's key to be and add lk to be's in-flight list.
+ *
+ * Returns negative if failed.
+ */
+static int backend_send(struct backend *be, struct lookup *lk)
+{
+    if (lk->add) {
+        size_t name_len = strlen(lk->key), msg_len = strlen(lk->msg);
+        if (buf_reserve(&be->out, MDB_REQ_ADD_HDR_LEN + name_len + msg_len) < 0)
+            return -1;
+        lk->id = be->next_id++;
+        unsigned char *p = (unsigned char *)be->out.data + be->out.len;
+        mdb_put32(p, lk->id);
+        mdb_put16(p + 4, MDB_ADD_REQ);
+        p[6] = name_len;
+        p[7] = msg_len;
+        memcpy(p + MDB_REQ_ADD_HDR_LEN, lk->key, name_len);
+        memcpy(p + MDB_REQ_ADD_HDR_LEN + name_len, lk->msg, msg_len);
+        be->out.len += MDB_REQ_ADD_HDR_LEN + name_len + msg_len;
+    } else if (be->srv->binary_backend) {
+        size_t key_len = strlen(lk->key);
+        if (buf_reserve(&be->out, MDB_REQ_HDR_LEN + key_len) < 0)
+            return -1;
+        lk->id = be->next_id++;
+        unsigned char *p = (unsigned char *)be->out.data + be->out.len;
+        mdb_put32(p, lk->id);
+        mdb_put16(p + 4, key_len);
+        memcpy(p + MDB_REQ_HDR_LEN, lk->key, key_len);
+        be->out.len += MDB_REQ_HDR_LEN + key_len;
+    } else {
+        // Write keyword to the backend.
+        if (buf_printf(&be->out, "%s\n", lk->key) < 0)
+            return -1;
+    }
+
+    lk->be = be;
+    timer_arm(&be->srv->timers, &lk->timer, now_ms() + be->srv->backend_timeout * 1000LL);
+    lk->sent_us = now_us();
+    lk->next = NULL;
+    if (be->inflight_tail)
+        be->inflight_tail->next = lk;
+    else
+        be->inflight_head = lk;
+    be->inflight_tail = lk;
+    be->ninflight++;
+    return 0;
+}
+
+/*
+ * Hand waiting lookups to backend connections with room for them, oldest
+ * lookup first, each to the least busy connection.
+ */
+static void backend_dispatch(struct server *srv)
+{
+    int depth = srv->binary_backend ? BACKEND_PIPELINE_DEPTH : 1;
+    int sent = 0;
+
+    while (srv->pending_head) {
+        struct backend *be = NULL;
+        int usable = 0;
+
+        for (int i = 0; i < srv->nbackends; i++) {
+            struct backend *b = &srv->backends[i];
+            if (b->fd >= 0)
+                usable = 1;
+            if (b->ready && b->ninflight < depth
+                    && (be == NULL || b->ninflight < be->ninflight))
+                be = b;
+        }
+
+        if (be == NULL) {
+            // If every connection is down, don't keep clients waiting for
+            // the next reconnect attempt.
+            if (!usable)
+                backend_reject_pending(srv, 503); // "Service Unavailable"
+            break;
+        }
+
+        struct lookup *lk = srv->pending_head;
+        srv->pending_head = lk->next;
+        if (srv->pending_head == NULL)
+            srv->pending_tail = NULL;
+
+        if (backend_send(be, lk) < 0) {
+            lookup_finish(srv, lk, 500);
+            continue;
+        }
+        sent = 1;
+    }
+
+    // Send everything we queued above, several keys per send() where a
+    // connection got more than one.
+    for (int i = 0; sent && i < srv->nbackends; i++)
+        if (srv->backends[i].out.len > srv->backends[i].out_sent)
+            backend_flush(&srv->backends[i]);
+}
+
+/*
+ * Queue lk for the next backend connection with room for it.
+ */
+static void backend_enqueue(struct server *srv, struct lookup *lk)
+{
+    lk->srv = srv;
+    timer_init(&lk->timer, &lookup_timeout, lk);
+    timer_arm(&srv->timers, &lk->timer, now_ms() + srv->backend_timeout * 1000LL);
+
+    lk->next = NULL;
+    if (srv->pending_tail)
+        srv->pending_tail->next = lk;
+    else
+        srv->pending_head = lk;
+    srv->pending_tail = lk;
+
+    backend_dispatch(srv);
+}
+
+/*
+ * Turn c's request away because the backend already has all the lookups it
+ * can get through in reasonable time.
+ */
+static void shed_request(struct conn *c)
+{
+    metrics_add(&c->srv->metrics.shed, 1);
+    send_error_status(c, 503); // "Service Unavailable"
+    conn_respond(c, 503);
+}
+
+/*
+ * Look up the normalized key for c, joining the lookup already under way for
+ * it if there is one.
+ */
+static void backend_lookup(struct server *srv, struct conn *c, const char *key)
+{
+    c->state = CONN_WAITING;
+
+    // A lookup that began before the cache was invalidated may return stale
+    // results, so don't join it.
+    unsigned generation = lookup_cache_generation();
+    struct lookup *lk = (struct lookup *)lru_get(&srv->inflight, key);
+
+    if (lk && lk->generation == generation) {
+        c->next = lk->waiters;
+        lk->waiters = c;
+        return;
+    }
+
+    // Joining costs the backend nothing, but a new lookup has to wait behind
+    // every one already queued; past max_lookups, that's too long.
+    if (srv->nlookups >= srv->max_lookups) {
+        shed_request(c);
+        return;
+    }
+
+    // Replaces the stale lookup in the table, if any; it still completes.
+    lk = calloc(1, sizeof(*lk));
+    if (lk == NULL || lru_put(&srv->inflight, &lk->lru, key, 0) < 0) {
+        free(lk);
+        send_error_status(c, 500);
+        conn_respond(c, 500);
+        return;
+    }
+
+    srv->nlookups++;
+    strcpy(lk->key, key);
+    lk->generation = generation;
+    c->next = NULL;
+    lk->waiters = c;
+
+    // The form goes ahead of the result rows.
+    buf_printf(&lk->body, "%s<p><table border>\n", mdb_lookup_form);
+
+    backend_enqueue(srv, lk);
+}
+
+/*
+ * Have mdb-lookup-server add a record for c. The name and msg must fit in
+ * MDB_KEY_LEN characters each.
+ */
+static void backend_add(struct server *srv, struct conn *c, const char *name,
+        const char *msg)
+{
+    c->state = CONN_WAITING;
+
+    if (srv->nlookups >= srv->max_lookups) {
+        shed_request(c);
+        return;
+    }
+
+    struct lookup *lk = calloc(1, sizeof(*lk));
+    if (lk == NULL) {
+        send_error_status(c, 500);
+        conn_respond(c, 500);
+        return;
+    }
+
+    srv->nlookups++;
+    lk->add = 1;
+    strcpy(lk->key, name);
+    strcpy(lk->msg, msg);
+    c->next = NULL;
+    lk->waiters = c;
+
+    // The answer is the record as stored, shown below the form.
+    buf_printf(&lk->body, "%s<p><table border>\n", mdb_add_form);
+
+    backend_enqueue(srv, lk);
+}
+
+/*
+ * Drop the backend connection and fail the lookups in flight on it, if any.
+ * We'll reconnect after a delay that doubles with every consecutive failure.
+ */
+static void backend_fail(struct backend *be)
+{
+    if (be->fd >= 0) {
+        close(be->fd);
+        metrics_add(&be->srv->metrics.backend_failures, 1);
+    }
+    be->fd = -1;
+    be->connected = 0;
+    be->ready = 0;
+    be->out.len = be->out_sent = 0;
+    be->in_len = 0;
+    be->rows = 0;
+    be->in_answer = 0;
+
+    if (be->backoff == 0)
+        be->backoff = BACKEND_MIN_BACKOFF;
+    else if ((be->backoff *= 2) > BACKEND_MAX_BACKOFF)
+        be->backoff = BACKEND_MAX_BACKOFF;
+    timer_arm(&be->srv->timers, &be->retry, now_ms() + be->backoff);
+
+    struct lookup *lk = be->inflight_head;
+    be->inflight_head = be->inflight_tail = NULL;
+    be->ninflight = 0;
+
+    while (lk) {
+        struct lookup *next = lk->next;
+        lookup_finish(be->srv, lk, 500);
+        lk = next;
+    }
+}
+
+/*
+ * be's reconnect delay is up, or, if it is connected, the server has gone
+ * backend_timeout seconds without finishing the handshake.
+ */
+static void backend_retry(void *arg)
+{
+    struct backend *be = arg;
+
+    if (be->fd >= 0) {
+        fprintf(stderr, "mdb lookup: handshake timed out\n");
+        backend_fail(be);
+        return;
+    }
+
+    if (backend_connect(be) < 0)
+        backend_fail(be);
+}
+
+/*
+ * The oldest lookup in flight on be has all its rows; answer it.
+ */
+static void backend_done(struct backend *be)
+{
+    struct lookup *lk = be->inflight_head;
+    int rows = be->rows;
+
+    be->inflight_head = lk->next;
+    if (be->inflight_head == NULL)
+        be->inflight_tail = NULL;
+    be->ninflight--;
+    be->rows = 0;
+
+    metrics_observe(&be->srv->metrics.backend_rtt, now_us() - lk->sent_us);
+
+    // An add comes back without its record if the server couldn't store it.
+    if (lk->add && rows == 0) {
+        lookup_finish(be->srv, lk, 500);
+        return;
+    }
+
+    buf_printf(&lk->body, "</table>\n</body></html>\n");
+    lookup_finish(be->srv, lk, 200);
+}
+
+/*
+ * Start the next result row of the oldest lookup in flight on be.
+ */
+static void backend_row(struct backend *be)
+{
+    struct lookup *lk = be->inflight_head;
+
+    //check if row number is even or odd to determine formatting
+    if (be->rows++ % 2 == 0)
+        buf_printf(&lk->body, "<tr><td>\n");
+    else
+        buf_printf(&lk->body, "<tr><td bgcolor=yellow>\n");
+}
+
+/*
+ * Add one line of mdb-lookup output to the oldest result in flight on be.
+ */
+static void backend_line(struct backend *be, const char *line, size_t len)
+{
+    // An empty line terminates the result.
+    if (len == 1) {
+        backend_done(be);
+        return;
+    }
+
+    backend_row(be);
+    buf_append_html(&be->inflight_head->body, line, len);
+}
+
+/*
+ * The server has answered be's handshake; it's ours to send lookups on.
+ */
+static void backend_ready(struct backend *be)
+{
+    timer_cancel(&be->srv->timers, &be->retry);
+    be->ready = 1;
+    be->connected_ms = now_ms();
+    be->backoff = 0;
+}
+
+/*
+ * Consume the complete text protocol lines in be->in.
+ *
+ * Returns the number of bytes consumed, or negative if the backend broke the
+ * protocol (in which case be has failed).
+ */
+static ssize_t backend_parse_text(struct backend *be)
+{
+    char *start = be->in, *end = be->in + be->in_len, *nl;
+
+    // The handshake is answered with the empty line.
+    if (!be->ready) {
+        if ((nl = memchr(start, '\n', end - start)) == NULL)
+            return 0;
+        if (nl != start) {
+            fprintf(stderr, "mdb lookup: unexpected handshake answer\n");
+            backend_fail(be);
+            return -1;
+        }
+        backend_ready(be);
+        start = nl + 1;
+    }
+
+    // Hand over every complete line.
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        if (be->inflight_head == NULL) {
+            fprintf(stderr, "mdb lookup: unexpected result line\n");
+            backend_fail(be);
+            return -1;
+        }
+        backend_line(be, start, nl + 1 - start);
+        start = nl + 1;
+    }
+    return start - be->in;
+}
+
+/*
+ * Consume the complete binary protocol answer headers and records in be->in,
+ * rendering records the same way mdb-lookup-server prints them.
+ *
+ * Returns the number of bytes consumed, or negative if the backend broke the
+ * protocol (in which case be has failed).
+ */
+static ssize_t backend_parse_binary(struct backend *be)
+{
+    const unsigned char *p = (const unsigned char *)be->in;
+    size_t len = be->in_len, pos = 0;
+
+    // The handshake is answered with the same magic.
+    if (!be->ready) {
+        if (len < MDB_PROTO_MAGIC_LEN)
+            return 0;
+        if (memcmp(p, MDB_PROTO_MAGIC, MDB_PROTO_MAGIC_LEN) != 0) {
+            fprintf(stderr, "mdb lookup: unexpected handshake answer\n");
+            backend_fail(be);
+            return -1;
+        }
+        backend_ready(be);
+        pos = MDB_PROTO_MAGIC_LEN;
+    }
+
+    for (;;) {
+        if (!be->in_answer) {
+            if (len - pos < MDB_RESP_HDR_LEN)
+                break;
+            if (be->inflight_head == NULL
+                    || mdb_get32(p + pos) != be->inflight_head->id) {
+                fprintf(stderr, "mdb lookup: unexpected answer\n");
+                backend_fail(be);
+                return -1;
+            }
+            be->rows_left = mdb_get32(p + pos + 4);
+            be->in_answer = 1;
+            pos += MDB_RESP_HDR_LEN;
+        }
+
+        if (be->rows_left == 0) {
+            be->in_answer = 0;
+            backend_done(be);
+            continue;
+        }
+
+        if (len - pos < MDB_REC_HDR_LEN)
+            break;
+        uint32_t recno = mdb_get32(p + pos);
+        int name_len = p[pos + 4];
+        int msg_len = p[pos + 5];
+        if (len - pos < (size_t)MDB_REC_HDR_LEN + name_len + msg_len)
+            break;
+
+        const char *name = (const char *)p + pos + MDB_REC_HDR_LEN;
+        struct buf *body = &be->inflight_head->body;
+        backend_row(be);
+        buf_printf(body, "%4u: {", (unsigned)recno);
+        buf_append_html(body, name, name_len);
+        buf_printf(body, "} said {");
+        buf_append_html(body, name + name_len, msg_len);
+        buf_printf(body, "}\n");
+        be->rows_left--;
+        pos += MDB_REC_HDR_LEN + name_len + msg_len;
+    }
+    return pos;
+}
+
+static void backend_handle(struct backend *be, uint32_t events)
+{
+    if (!be->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(be->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+        if (err) {
+            fprintf(stderr, "connect: %s\n", strerror(err));
+            backend_fail(be);
+            return;
+        }
+        if (!(events & EPOLLOUT))
+            return;
+        be->connected = 1;
+    }
+
+    if (events & EPOLLOUT)
+        backend_flush(be);
+    if (be->fd < 0 || !(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        return;
+
+    for (;;) {
+        ssize_t n = recv(be->fd, be->in + be->in_len, sizeof(be->in) - be->in_len, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            perror("mdb lookup");
+            backend_fail(be);
+            return;
+        }
+        if (n == 0) {
+            // mdb-lookup-server drops connections that sit idle too long.
+            // That's no failure, so reconnect right away, unless it's
+            // dropping us as soon as we connect.
+            if (be->ready && be->ninflight == 0
+                    && now_ms() - be->connected_ms >= BACKEND_MAX_BACKOFF) {
+                close(be->fd);
+                be->fd = -1;
+                if (backend_connect(be) < 0)
+                    backend_fail(be);
+                return;
+            }
+            fprintf(stderr, "mdb lookup: connection closed by server\n");
+            backend_fail(be);
+            return;
+        }
+        be->in_len += n;
+
+        ssize_t used = be->srv->binary_backend
+            ? backend_parse_binary(be) : backend_parse_text(be);
+        if (used < 0)
+            return;
+
+        // Lines and records never come close to filling the buffer; if one
+        // does, the backend is not speaking our protocol.
+        if (used == 0 && be->in_len == sizeof(be->in)) {
+            fprintf(stderr, "mdb lookup: line too long\n");
+            backend_fail(be);
+            return;
+        }
+        be->in_len -= used;
+        memmove(be->in, be->in + used, be->in_len);
+    }
+}
+
+/*
+ * Request handling.
+ */
+
+/*
+ * Returns nonzero if the comma-separated header value contains token,
+ * ignoring case.
+ */
+static int has_token(const char *value, size_t len, const char *token)
+{
+    size_t token_len = strlen(token);
+    const char *end = value + len;
+
+    while (value < end) {
+        while (value < end && (*value == ',' || *value == ' ' || *value == '\t'))
+            value++;
+        const char *t_end = value;
+        while (t_end < end && *t_end != ',' && *t_end != ' ' && *t_end != '\t')
+            t_end++;
+        if ((size_t)(t_end - value) == token_len && strncasecmp(value, token, token_len) == 0)
+            return 1;
+        value = t_end;
+    }
+    return 0;
+}
+
+/*
+ * Returns nonzero if the Accept-Encoding value allows gzip, i.e., lists gzip
+ * or "*" without "q=0".
+ */
+static int accepts_gzip(const char *value, size_t len)
+{
+    const char *end = value + len;
+
+    while (value < end) {
+        const char *item_end = memchr(value, ',', end - value);
+        if (item_end == NULL)
+            item_end = end;
+
+        while (value < item_end && (*value == ' ' || *value == '\t'))
+            value++;
+        const char *coding_end = value;
+        while (coding_end < item_end && *coding_end != ';'
+                && *coding_end != ' ' && *coding_end != '\t')
+            coding_end++;
+
+        size_t n = coding_end - value;
+        if ((n == 4 && strncasecmp(value, "gzip", 4) == 0) || (n == 1 && *value == '*')) {
+            for (const char *q = coding_end; q + 1 < item_end; q++)
+                if ((q[0] == 'q' || q[0] == 'Q') && q[1] == '=')
+                    return strtod(q + 2, NULL) > 0;
+            return 1;
+        }
+
+        value = item_end + 1;
+    }
+    return 0;
+}
+
+/*
+ * Answer a request we can't make sense of with an error, and close the
+ * connection afterwards since we can't trust the rest of the stream either.
+ */
+static void reject_request(struct conn *c, int status_code)
+{
+    if (!c->started_us)
+        c->started_us = now_us();
+    c->keep_alive = 0;
+    send_error_status(c, status_code);
+    conn_respond(c, status_code);
+}
+
+static int hex_value(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Find field name in the application/x-www-form-urlencoded form of len bytes
+ * at form, and decode its value into dst, which has room for size bytes.
+ *
+ * Returns the length of the value; returns negative if the field is missing,
+ * badly encoded, too long for dst, or holds a control character (a line
+ * break would end the record early in mdb-lookup-server's text protocol).
+ */
+static int form_field(const char *form, size_t len, const char *name, char *dst,
+        size_t size)
+{
+    size_t name_len = strlen(name);
+    const char *end = form + len;
+
+    while (form < end) {
+        const char *field_end = memchr(form, '&', end - form);
+        if (field_end == NULL)
+            field_end = end;
+
+        if ((size_t)(field_end - form) > name_len && form[name_len] == '='
+                && strncmp(form, name, name_len) == 0) {
+            size_t n = 0;
+            for (const char *p = form + name_len + 1; p < field_end; p++) {
+                char ch = *p;
+                if (ch == '+') {
+                    ch = ' ';
+                } else if (ch == '%') {
+                    if (field_end - p < 3 || hex_value(p[1]) < 0 || hex_value(p[2]) < 0)
+                        return -1;
+                    ch = hex_value(p[1]) << 4 | hex_value(p[2]);
+                    p += 2;
+                }
+                if ((unsigned char)ch < 0x20 || ch == 0x7f || n + 1 >= size)
+                    return -1;
+                dst[n++] = ch;
+            }
+            dst[n] = '\0';
+            return n;
+        }
+
+        form = field_end + 1;
+    }
+    return -1;
+}
+
+/*
+ * Handle /server-status: every worker's metrics, added up, in the Prometheus
+ * text format.
+ */
+static void handle_status_request(struct conn *c)
+{
+    struct metrics *workers[nservers];
+    for (int i = 0; i < nservers; i++)
+        workers[i] = &servers[i].metrics;
+
+    size_t len;
+    char *text = metrics_render(workers, nservers, &len);
+    if (text == NULL || buf_append(&c->body, text, len) < 0) {
+        free(text);
+        send_error_status(c, 500);
+        conn_respond(c, 500);
+        return;
+    }
+    free(text);
+
+    send_status_line(c, 200);
+    buf_printf(&c->out, "Content-Type: text/plain; version=0.0.4\r\n");
+    send_body(c);
+    conn_respond(c, 200);
+}
+
+/*
+ * Handle POST /mdb-add: the form in the body of len bytes at body gives the
+ * name and msg of the record to add.
+ */
+static void handle_add_request(struct conn *c, const char *body, size_t len)
+{
+    char name[MDB_KEY_LEN + 1], msg[MDB_KEY_LEN + 1];
+
+    // Only the binary protocol can add records.
+    if (!c->srv->binary_backend) {
+        send_error_status(c, 501); // "Not Implemented"
+        conn_respond(c, 501);
+        return;
+    }
+
+    if (form_field(body, len, "name", name, sizeof(name)) < 0
+            || form_field(body, len, "msg", msg, sizeof(msg)) < 0) {
+        send_error_status(c, 400); // "Bad Request"
+        conn_respond(c, 400);
+        return;
+    }
+
+    backend_add(c->srv, c, name, msg);
+}
+
+/*
+ * Make a string of the slice s of c->req by writing a NUL over the space or
+ * line end that follows it.
+ */
+static char *slice_str(struct conn *c, struct http_slice s)
+{
+    char *str = c->req + (s.p - c->req);
+    str[s.len] = '\0';
+    return str;
+}
+
+/*
+ * We have the whole request in c->req, up to c->req_end, and c->parser has
+ * been over its request line and headers; handle the request.
+ */
+static void handle_request(struct conn *c)
+{
+    struct server *srv = c->srv;
+    struct http_parser *p = &c->parser;
 
-    if (bind(serv_fd, info->ai_addr, info->ai_addrlen) < 0)
-        die("bind");
+    conn_stop_reading(c);
+    c->state = CONN_WRITING;
+    c->keep_alive = 0;
+    c->nrequests++;
+    c->started_us = now_us();
 
-    if (listen(serv_fd, 8) < 0)
-        die("listen");
+    /*
+     * Let's check the request line. The parser has split it up already; the
+     * headers are only ever used as slices, so the request line's parts can
+     * be made strings in place.
+     */
 
-    freeaddrinfo(info);
+    c->method = slice_str(c, p->method);
+    c->request_uri = slice_str(c, p->uri);
+    c->http_version = slice_str(c, p->version);
+
+    // Note: We must not modify the request line past this point, because
+    // method, request_uri, and http_version point to within it.
+
+    // We only support GET requests, and POST for adding records.
+    int post = strcmp(c->method, "POST") == 0;
+    if (strcmp(c->method, "GET") && !(post && strcmp(c->request_uri, "/mdb-add") == 0)) {
+        reject_request(c, 501); // "Not Implemented"
+        return;
+    }
+
+    // We only support HTTP/1.0 and HTTP/1.1.
+    if (strcmp(c->http_version, "HTTP/1.0") && strcmp(c->http_version, "HTTP/1.1")) {
+        reject_request(c, 501); // "Not Implemented"
+        return;
+    }
+
+    // request_uri must begin with "/".
+    if (*c->request_uri != '/') {
+        reject_request(c, 400); // "Bad Request"
+        return;
+    }
+
+    // Ensure request_uri does not contain "/../" and does not end with "/..".
+    size_t uri_len = strlen(c->request_uri);
+    if (uri_len >= 3) {
+        char *tail = c->request_uri + (uri_len - 3);
+        if (strcmp(tail, "/..") == 0 || strstr(c->request_uri, "/../") != NULL) {
+            reject_request(c, 400); // "Bad Request"
+            return;
+        }
+    }
+
+    /*
+     * Decide whether the connection stays open after this request: HTTP/1.1
+     * connections are persistent unless the client says otherwise, HTTP/1.0
+     * ones only if the client asks.
+     */
+
+    const struct http_slice *conn_hdr = http_find_header(p, "Connection");
+
+    if (strcmp(c->http_version, "HTTP/1.1") == 0)
+        c->keep_alive = !(conn_hdr && has_token(conn_hdr->p, conn_hdr->len, "close"));
+    else
+        c->keep_alive = conn_hdr && has_token(conn_hdr->p, conn_hdr->len, "keep-alive");
+
+    if (c->nrequests >= srv->max_requests)
+        c->keep_alive = 0;
+
+    const struct http_slice *enc_hdr = http_find_header(p, "Accept-Encoding");
+    c->accept_gzip = enc_hdr && accepts_gzip(enc_hdr->p, enc_hdr->len);
 
     /*
-     * Server accept() loop.
+     * We have a well-formed HTTP GET request; time to handle it.
      */
 
+    if (post) {
+        c->route = ROUTE_MDB;
+        handle_add_request(c, c->req + p->header_len, c->content_length);
+    }
+    else if (strcmp(c->request_uri, "/server-status") == 0) {
+        handle_status_request(c);
+    }
+    else if (strcmp(c->request_uri, "/mdb-add") == 0) {
+        c->route = ROUTE_MDB;
+        buf_printf(&c->body, "%s</body></html>\n", mdb_add_form);
+        send_status_line(c, 200);
+        send_body(c);
+        conn_respond(c, 200);
+    }
+    //if there is a key in the request uri, mdb-lookup the key in the database
+    else if (strncmp(c->request_uri, "/mdb-lookup?key=", strlen("/mdb-lookup?key=")) == 0) {
+        c->route = ROUTE_MDB;
+        char *key = c->request_uri + strlen("/mdb-lookup?key=");
+
+        // Popular keys are answered from memory.
+        struct lookup_cache_entry *e;
+        char norm_key[MDB_KEY_LEN + 1];
+        lookup_cache_key(norm_key, key);
+
+        if (srv->lookups.lru.max_bytes
+                && (e = lookup_cache_get(&srv->lookups, norm_key)) != NULL) {
+            send_status_line(c, 200);
+            send_data(c, e->data, e->len);
+            lookup_cache_hold(e);
+            c->lookup_ref = e;
+            conn_respond(c, 200);
+            return;
+        }
+
+        backend_lookup(srv, c, norm_key);
+    }
+    else if (strcmp(c->request_uri, "/mdb-lookup") == 0
+            || strncmp(c->request_uri, "/mdb-lookup?", strlen("/mdb-lookup?")) == 0) {
+        c->route = ROUTE_MDB;
+        buf_printf(&c->body, "%s</body></html>\n", mdb_lookup_form);
+        send_status_line(c, 200);
+        send_body(c);
+        conn_respond(c, 200);
+    }
+    else {
+        c->route = ROUTE_STATIC;
+        conn_respond(c, handle_file_request(srv->web_root, c->request_uri, c));
+    }
+}
+
+/*
+ * If c->req holds a complete request line, headers, and body, set c->req_end
+ * to just past them and return 200.
+ *
+ * Returns 0 if we need more, or the error status to reject the request with
+ * if we can't read it at all.
+ */
+static int request_complete(struct conn *c)
+{
+    // The parser only looks at what has arrived since the last call.
+    int status_code = http_parse(&c->parser, c->req, c->req_len);
+    if (status_code != 200)
+        return status_code;
+    size_t hdr_end = c->parser.header_len;
+
+    // A body follows if Content-Length says so; we don't take chunked ones.
+    if (http_find_header(&c->parser, "Transfer-Encoding"))
+        return 411; // "Length Required"
+
+    const struct http_slice *cl = http_find_header(&c->parser, "Content-Length");
+    c->content_length = 0;
+    if (cl) {
+        // The value is followed by the line end, so strtoull() stops there.
+        char *end;
+        errno = 0;
+        unsigned long long n = strtoull(cl->p, &end, 10);
+        if (cl->len == 0 || *cl->p < '0' || *cl->p > '9' || end != cl->p + cl->len || errno)
+            return 400; // "Bad Request"
+        if (n > MAX_REQUEST_SIZE - hdr_end)
+            return 413; // "Payload Too Large"
+        c->content_length = n;
+    }
+
+    if (c->req_len < hdr_end + c->content_length)
+        return 0;
+    c->req_end = hdr_end + c->content_length;
+    return 200;
+}
+
+/*
+ * Read as much of the request as is available; handle it once we have seen
+ * the blank line that ends the headers.
+ */
+static void conn_read(struct conn *c)
+{
+    for (;;) {
+        int status_code = request_complete(c);
+        if (status_code == 200) {
+            handle_request(c);
+            return;
+        }
+        if (status_code) {
+            reject_request(c, status_code);
+            return;
+        }
+
+        // The parser turns down requests that wouldn't fit, so there's room.
+        ssize_t n = recv(c->fd, c->req + c->req_len, MAX_REQUEST_SIZE - c->req_len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return; // wait for EPOLLIN
+        if (n <= 0) {
+            if (n < 0)
+                perror("recv");
+
+            // A client may close a persistent connection between requests;
+            // anything else means the socket closed prematurely.
+            if (c->req_len > 0 || c->nrequests == 0) {
+                c->status_code = 400; // "Bad Request"
+                conn_log(c);
+            }
+            conn_close(c);
+            return;
+        }
+
+        // The next request on a persistent connection has begun; it gets
+        // header_timeout from here, like the first one.
+        if (c->req_len == 0 && c->nrequests > 0)
+            timer_arm(&c->srv->timers, &c->timer,
+                    now_ms() + c->srv->header_timeout * 1000LL);
+
+        c->req_len += n;
+        c->req[c->req_len] = '\0';
+    }
+}
+
+/*
+ * c's timer went off: the request, the next request, or the client taking
+ * the response took too long.
+ */
+static void conn_timeout(void *arg)
+{
+    struct conn *c = arg;
+
+    if (c->state == CONN_READING && c->req_len > 0) {
+        // The client started a request but never finished it.
+        reject_request(c, 408); // "Request Timeout"
+        return;
+    }
+
+    // Reset a client that stopped reading rather than close gracefully, so
+    // that the kernel doesn't go on holding the rest of the response for it.
+    if (c->state == CONN_WRITING) {
+        struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    conn_close(c);
+}
+
+static void conn_handle(struct conn *c, uint32_t events)
+{
+    if (c->state == CONN_READING && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+        conn_read(c);
+    else if (c->state == CONN_WRITING && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+        conn_write(c);
+    // While CONN_WAITING we don't care about the socket; if the client went
+    // away, we'll find out when we send the result.
+}
+
+/*
+ * Turn away a connection we have no room for with a 503, without reading its
+ * request or setting anything up for it, so that shedding load costs next to
+ * nothing.
+ */
+static void shed_connection(struct server *srv, int fd)
+{
+    static const char response[] =
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Retry-After: " STR(RETRY_AFTER) "\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
+    metrics_add(&srv->metrics.shed, 1);
+
+    // A new socket's buffer always has room for this much.
+    send(fd, response, sizeof(response) - 1, MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+
+    // Drain what the client sent so that close() doesn't reset the
+    // connection before the response arrives.
+    while (recv(fd, srv->io_buf, sizeof(srv->io_buf), 0) > 0)
+        ;
+    close(fd);
+}
+
+/*
+ * Accept every pending connection on the listening socket.
+ */
+static void accept_connections(struct server *srv)
+{
     for (;;) {
         // We only need sockaddr_in since we only accept IPv4 peers.
         struct sockaddr_in clnt_addr;
         socklen_t clnt_len = sizeof(clnt_addr);
 
-        int clnt_fd = accept(serv_fd, (struct sockaddr *)&clnt_addr, &clnt_len);
-        if (clnt_fd < 0)
-            die("accept");
-        char clnt_ip[INET_ADDRSTRLEN];
+        int clnt_fd = accept4(srv->serv_fd, (struct sockaddr *)&clnt_addr, &clnt_len,
+                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clnt_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        if (srv->nconns >= srv->max_conns) {
+            shed_connection(srv, clnt_fd);
+            continue;
+        }
 
-        if (inet_ntop(AF_INET, &clnt_addr.sin_addr, clnt_ip, sizeof(clnt_ip))
+        struct conn *c = calloc(1, sizeof(*c));
+        if (c == NULL) {
+            perror("calloc");
+            close(clnt_fd);
+            continue;
+        }
+        c->fd = clnt_fd;
+        c->srv = srv;
+        c->file_fd = -1;
+        c->route = ROUTE_OTHER;
+        http_parser_init(&c->parser, MAX_REQUEST_SIZE);
+        timer_init(&c->timer, &conn_timeout, c);
+
+        if (inet_ntop(AF_INET, &clnt_addr.sin_addr, c->clnt_ip, sizeof(c->clnt_ip))
             == NULL)
-            die("inet_ntop");
+            strcpy(c->clnt_ip, "?");
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = c,
+        };
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, clnt_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(clnt_fd);
+            free(c);
+            continue;
+        }
 
-        /*
-     * Open client file descriptor as FILE pointers.
-     */
-    FILE *clnt_r = fdopen(clnt_fd, "rb");
-    if (clnt_r == NULL)
-        die("fdopen");
+        srv->nconns++;
+        metrics_gauge_add(&srv->metrics.open_conns, 1);
 
-    FILE *clnt_w = fdopen(dup(clnt_fd), "wb");
-    if (clnt_w == NULL)
-        die("fdopen");
+        // The request is often already here; don't wait for the event.
+        conn_start_reading(c);
+        conn_read(c);
+    }
+}
 
-    /*
-     * Let's parse the request line.
-     */
+static void server_run(struct server *srv)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
 
-    // Note: we'll use these fields at the end when we log the connection.
-    int status_code;
-    char *method = NULL, *request_uri = NULL, *http_version = NULL, *extra;
+    for (;;) {
+        int n = epoll_wait(srv->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait");
+        }
 
-    char request_buf[MAX_LINE_LENGTH];
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == NULL) {
+                accept_connections(srv);
+            } else if (ptr == &srv->files) {
+                file_cache_handle_events(&srv->files);
+            } else if (ptr == &srv->gzips) {
+                file_cache_handle_events(&srv->gzips);
+            } else if ((uintptr_t)ptr >= (uintptr_t)srv->backends
+                    && (uintptr_t)ptr < (uintptr_t)(srv->backends + srv->nbackends)) {
+                struct backend *be = ptr;
+                if (be->fd >= 0)
+                    backend_handle(be, events[i].events);
+            } else {
+                struct conn *c = ptr;
+                if (c->fd >= 0)
+                    conn_handle(c, events[i].events);
+            }
+        }
 
-    if (fgets(request_buf, sizeof(request_buf), clnt_r) == NULL) {
-        // Socket closed prematurely; there isn't much we can do
-        status_code = 400; // "Bad Request"
-        goto terminate_connection;
-    }
+        // Time out whatever is overdue.
+        timer_wheel_advance(&srv->timers, now_ms());
+
+        // Handle requests that were pipelined behind the ones we answered,
+        // including answers from timeouts.
+        while (srv->ready) {
+            struct conn *c = srv->ready;
+            srv->ready = c->ready_next;
+            c->on_ready = 0;
+            if (c->fd >= 0 && c->state == CONN_READING)
+                conn_read(c);
+        }
 
-    char *token_separators = "\t \r\n"; // tab, space, new line
+        // Hand the backend connections any lookups that came in or were
+        // waiting for room. Requests it answers right away (with an error)
+        // may have more behind them; don't wait for I/O to get to those.
+        backend_dispatch(srv);
+        timeout = srv->ready ? 0 : timer_wheel_timeout(&srv->timers, now_ms());
 
-    method = strtok(request_buf, token_separators);
-    request_uri = strtok(NULL, token_separators);
-    http_version = strtok(NULL, token_separators);
-    extra = strtok(NULL, token_separators);
+        while (srv->closed) {
+            struct conn *c = srv->closed;
+            srv->closed = c->next;
+            conn_free(c);
+        }
+    }
+}
+
+/*
+ * Construct a non-blocking socket listening on http_port.
+ *
+ * SO_REUSEPORT lets every worker bind its own socket to the same port. Up to
+ * backlog connections wait to be accepted; the kernel drops any more.
+ */
+static int open_listener(const char *http_port, int backlog)
+{
+    struct addrinfo hints, *info;
 
-    // Note: We must not modify request_buf past this point, because method,
-    // request_uri, http_version, and extra point to within request_buf.
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;       // Only accept IPv4 addresses
+    hints.ai_socktype = SOCK_STREAM; // stream socket for TCP connections
+    hints.ai_protocol = IPPROTO_TCP; // TCP protocol
+    hints.ai_flags = AI_PASSIVE;     // Construct socket address for bind()ing
 
-    // Check that we have exactly three tokens in the request line.
-    if (!method || !request_uri || !http_version || extra) {
-        status_code = 501; // "Not Implemented"
-        send_error_status(clnt_w, status_code);
-        goto terminate_connection;
+    int addr_err;
+    if ((addr_err = getaddrinfo(NULL, http_port, &hints, &info)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(addr_err));
+        exit(1);
     }
 
-    // We only support GET requests.
-    if (strcmp(method, "GET")) {
- status_code = 501; // "Not Implemented"
-        send_error_status(clnt_w, status_code);
-        goto terminate_connection;
-    }
-// We only support GET requests.
-    if (strcmp(method, "GET")) {
- status_code = 501; // "Not Implemented"
-        send_error_status(clnt_w, status_code);
-        goto terminate_connection;
+    int serv_fd = socket(info->ai_family, info->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            info->ai_protocol);
+    if (serv_fd < 0)
+        die("socket");
+
+    int one = 1;
+    if (setsockopt(serv_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        die("setsockopt(SO_REUSEPORT)");
+
+    if (bind(serv_fd, info->ai_addr, info->ai_addrlen) < 0)
+        die("bind");
+
+    if (listen(serv_fd, backlog) < 0)
+        die("listen");
+
+    freeaddrinfo(info);
+
+    return serv_fd;
+}
+
+/*
+ * Set up a worker's listener, epoll instance, and backend connections.
+ */
+static void server_init(struct server *srv, const char *http_port, size_t cache_size,
+        size_t gzip_cache_size, size_t lookup_cache_size, int lookup_cache_ttl,
+        int nbackends, int backlog)
+{
+    srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv->epfd < 0)
+        die("epoll_create1");
+
+    timer_wheel_init(&srv->timers, now_ms());
+
+    if (file_cache_init(&srv->files, cache_size) < 0)
+        die("file_cache_init");
+
+    if (lookup_cache_init(&srv->lookups, lookup_cache_size, lookup_cache_ttl * 1000) < 0)
+        die("lookup_cache_init");
+
+    if (lru_init(&srv->inflight, SIZE_MAX, &forget_lookup) < 0)
+        die("lru_init");
+
+    if (log_ring_init(&srv->log, LOG_RING_SIZE) < 0)
+        die("log_ring_init");
+
+    if (srv->files.inotify_fd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &srv->files };
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->files.inotify_fd, &ev) < 0)
+            die("epoll_ctl");
     }
 
-    // We only support HTTP/1.0 and HTTP/1.1.
-    if (strcmp(http_version, "HTTP/1.0") && strcmp(http_version, "HTTP/1.1")) {
-        status_code = 501; // "Not Implemented"
-        send_error_status(clnt_w, status_code);
-        goto terminate_connection;
+    if (file_cache_init(&srv->gzips, gzip_cache_size) < 0)
+        die("file_cache_init");
+
+    if (srv->gzips.inotify_fd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &srv->gzips };
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->gzips.inotify_fd, &ev) < 0)
+            die("epoll_ctl");
     }
 
-    // request_uri must begin with "/".
-    if (!request_uri || *request_uri != '/') {
-        status_code = 400; // "Bad Request"
-        send_error_status(clnt_w, status_code);
-        goto terminate_connection;
+    // Construct mdb-lookup sockets here; any that fail are retried later.
+    srv->backends = calloc(nbackends, sizeof(*srv->backends));
+    if (srv->backends == NULL)
+        die("calloc");
+    srv->nbackends = nbackends;
+
+    for (int i = 0; i < nbackends; i++) {
+        struct backend *be = &srv->backends[i];
+        be->srv = srv;
+        be->fd = -1;
+        timer_init(&be->retry, &backend_retry, be);
+        if (backend_connect(be) < 0)
+            backend_fail(be);
     }
 
-    // Ensure request_uri does not contain "/../" and does not end with "/..".
-    int uri_len = strlen(request_uri);
-    if (uri_len >= 3) {
-        char *tail = request_uri + (uri_len - 3);
-        if (strcmp(tail, "/..") == 0 || strstr(request_uri, "/../") != NULL) {
-            status_code = 400; // "Bad Request"
-            send_error_status(clnt_w, status_code);
-            goto terminate_connection;
-        }
+    srv->serv_fd = open_listener(http_port, backlog);
+
+    // The listening socket is level-triggered, so connections we couldn't
+    // accept this round (e.g., out of descriptors) are retried next round.
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, srv->serv_fd, &ev) < 0)
+        die("epoll_ctl");
+}
+
+/*
+ * Parse a size in bytes, optionally suffixed with K, M, or G.
+ *
+ * Returns negative if str is not a valid size.
+ */
+static long long parse_size(const char *str)
+{
+    char *end;
+    long long n = strtoll(str, &end, 10);
+
+    if (end == str || n < 0)
+        return -1;
+
+    switch (*end) {
+    case 'G': case 'g': n <<= 10; // fall through
+    case 'M': case 'm': n <<= 10; // fall through
+    case 'K': case 'k': n <<= 10; end++;
     }
 
+    return *end ? -1 : n;
+}
+
+/*
+ * SIGHUP tells us the database changed; forget every cached lookup result.
+ */
+static void handle_sighup(int sig)
+{
+    lookup_cache_invalidate_all();
+}
+
+/*
+ * SIGUSR1 tells us the access log was rotated; start a new one.
+ */
+static void handle_sigusr1(int sig)
+{
+    access_log_reopen();
+}
+
+static void *worker_main(void *arg)
+{
+    server_run(arg);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
     /*
-     * Skip HTTP headers.
+     * Configure signal-handling.
      */
 
-    // We need another buffer for trashing the headers, because request_buf
-    // still currently holds the method, request_uri, and http_version strings.
-    char line_buf[MAX_LINE_LENGTH];
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
 
-    while (1) {
-        if (fgets(line_buf, sizeof(line_buf), clnt_r) == NULL) {
-            // Socket closed prematurely; there isn't much we can do
-            status_code = 400; // "Bad Request"
-            goto terminate_connection;
-        }
+    // Ignore SIGPIPE so that we don't terminate when we call
+    // send() on a disconnected socket.
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, NULL))
+        die("sigaction(SIGPIPE)");
 
-        // Check if we have reached the end of the headers, i.e., an empty line.
-        if (strcmp("\r\n", line_buf) == 0 || strcmp("\n", line_buf) == 0)
-            break;
-    }
-/*
-     * We have a well-formed HTTP GET request; time to handle it.
+    sa.sa_handler = &handle_sighup;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGHUP, &sa, NULL))
+        die("sigaction(SIGHUP)");
+
+    sa.sa_handler = &handle_sigusr1;
+    if (sigaction(SIGUSR1, &sa, NULL))
+        die("sigaction(SIGUSR1)");
+
+    /*
+     * Parse arguments.
      */
-   
-    //if there is a key in the request uri, mdb-lookup the key in the database
-         if(strncmp(request_uri, "/mdb-lookup?key=", strlen("/mdb-lookup?key=")) == 0) {
-             const char *form =
-           "<html><body>\n"
-           "<h1>mdb-lookup</h1>\n"
-           "<p>\n"
-           "<form method=GET action=/mdb-lookup>\n"
-           "lookup: <input type=text name=key>\n"
-           "<input type=submit>\n"
-           "</form>\n"
-           "<p>\n";
-
-            char *key = request_uri + strlen("/mdb-lookup?key=");
-            //write keyword to mdb_fpw
-            fprintf(mdb_fpw, "%s\n", key);
-            fflush(mdb_fpw);
-           
-            char mdb_line[1000];
-            int count = 0;
-            
-            while(1) {
-                if(fgets(mdb_line, sizeof(mdb_line), mdb_fpr) == NULL) {
-                    status_code = 500;
-                    send_error_status(clnt_w, status_code);
-                    goto terminate_connection;
-                }
-                else if(count == 0) {
-                    status_code = 200;
-                    send_status_line(clnt_w, status_code);
-                    send_blank_line(clnt_w);
-                    fprintf(clnt_w, "%s", form);
-                    fprintf(clnt_w, "<p><table border>\n");
-                    fflush(clnt_w);
-                }
-                if(strcmp(mdb_line, "\n") == 0) {
-                    break;
-                }
-                //check if row number is even or odd to determine formatting
-                if(count%2 == 0) {
-                    fprintf(clnt_w, "<tr><td>\n");
-                    fprintf(clnt_w, "%s", mdb_line);
-                    //fprintf(clnt_w, "mom");
-                    fflush(clnt_w);
-                    count++;
-                }
-                else {
-                    fprintf(clnt_w, "<tr><td bgcolor=yellow>\n");
-                    fprintf(clnt_w, "%s", mdb_line);
-                    fflush(clnt_w);
-                    count++;
-                }
-            }
-            if(ferror(mdb_fpr)) {
-                die("mdb lookup");
+
+    static const struct option long_options[] = {
+        { "workers", required_argument, NULL, 'w' },
+        { "cache-size", required_argument, NULL, 'c' },
+        { "gzip-cache-size", required_argument, NULL, 'z' },
+        { "keepalive-timeout", required_argument, NULL, 'k' },
+        { "header-timeout", required_argument, NULL, 'H' },
+        { "write-timeout", required_argument, NULL, 'W' },
+        { "backend-timeout", required_argument, NULL, 'T' },
+        { "max-requests", required_argument, NULL, 'm' },
+        { "max-conns", required_argument, NULL, 'N' },
+        { "max-lookups", required_argument, NULL, 'P' },
+        { "backlog", required_argument, NULL, 'Q' },
+        { "backend-conns", required_argument, NULL, 'b' },
+        { "lookup-cache-size", required_argument, NULL, 'l' },
+        { "lookup-cache-ttl", required_argument, NULL, 't' },
+        { "binary-backend", no_argument, NULL, 'B' },
+        { "access-log", required_argument, NULL, 'L' },
+        { "log-sample", required_argument, NULL, 's' },
+        { "cache-control", required_argument, NULL, 'C' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = ncpus > 0 ? ncpus : 1;
+    long long cache_size = DEFAULT_CACHE_SIZE;
+    long long gzip_cache_size = DEFAULT_GZIP_CACHE_SIZE;
+    int keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
+    int header_timeout = DEFAULT_HEADER_TIMEOUT;
+    int write_timeout = DEFAULT_WRITE_TIMEOUT;
+    int backend_timeout = DEFAULT_BACKEND_TIMEOUT;
+    int max_requests = DEFAULT_MAX_REQUESTS;
+    int max_conns = DEFAULT_MAX_CONNS;
+    int max_lookups = DEFAULT_MAX_LOOKUPS;
+    int backlog = MAXPENDING;
+    int backend_conns = -1; // DEFAULT_BACKEND_CONNS, within DEFAULT_BACKEND_POOL
+    long long lookup_cache_size = DEFAULT_LOOKUP_CACHE_SIZE;
+    int lookup_cache_ttl = DEFAULT_LOOKUP_CACHE_TTL;
+    int binary_backend = 0;
+    const char *access_log = NULL;
+    int log_sample = 1;
+    struct cache_rule *cache_rules = NULL;
+    int ncache_rules = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "w:c:z:k:H:W:T:m:N:P:Q:b:l:t:BL:s:C:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'C': // <prefix>=<secs>: Cache-Control max-age for files under prefix
+            {
+                char *eq = strrchr(optarg, '=');
+                char *end;
+                if (eq == NULL || *optarg != '/')
+                    goto usage;
+                long max_age = strtol(eq + 1, &end, 10);
+                if (end == eq + 1 || *end || max_age < 0)
+                    goto usage;
+
+                cache_rules = realloc(cache_rules, (ncache_rules + 1) * sizeof(*cache_rules));
+                if (cache_rules == NULL)
+                    die("realloc");
+                cache_rules[ncache_rules++] = (struct cache_rule){
+                    optarg, eq - optarg, max_age
+                };
             }
-            fprintf(clnt_w, "</table>\n</body></html>\n");
-            fflush(clnt_w);
-
-    }
-    else if(strcmp(request_uri, "/mdb-lookup") == 0 || strncmp(request_uri, "/mdb-lookup?", strlen("/mdb-lookup?")) == 0) {
-             const char *form =
-           "<html><body>\n"
-           "<h1>mdb-lookup</h1>\n"
-           "<p>\n"
-           "<form method=GET action=/mdb-lookup>\n"
-           "lookup: <input type=text name=key>\n"
-           "<input type=submit>\n"
-           "</form>\n"
-           "<p>\n"
-           "</body></html>\n";    
-
-            status_code = 200;
-            send_status_line(clnt_w, status_code);
-            send_blank_line(clnt_w);
-            fprintf(clnt_w, "%s", form); 
+            break;
+        case 'L': // access log file; "-" (the default) is stderr
+            access_log = strcmp(optarg, "-") ? optarg : NULL;
+            break;
+        case 's': // log only every n'th request
+            log_sample = atoi(optarg);
+            if (log_sample <= 0)
+                goto usage;
+            break;
+        case 'B': // pipeline lookups over mdb-lookup-server's binary protocol
+            binary_backend = 1;
+            break;
+        case 'l': // bytes of lookup results cached per worker; 0 disables it
+            lookup_cache_size = parse_size(optarg);
+            if (lookup_cache_size < 0)
+                goto usage;
+            break;
+        case 't': // seconds a cached lookup result is served
+            lookup_cache_ttl = atoi(optarg);
+            if (lookup_cache_ttl <= 0)
+                goto usage;
+            break;
+        case 'b': // mdb-lookup connections per worker
+            backend_conns = atoi(optarg);
+            if (backend_conns <= 0)
+                goto usage;
+            break;
+        case 'k': // seconds a connection may wait for its next request
+            keepalive_timeout = atoi(optarg);
+            if (keepalive_timeout <= 0)
+                goto usage;
+            break;
+        case 'H': // seconds a client may take to send a whole request
+            header_timeout = atoi(optarg);
+            if (header_timeout <= 0)
+                goto usage;
+            break;
+        case 'W': // seconds a client may take no response data before we drop it
+            write_timeout = atoi(optarg);
+            if (write_timeout <= 0)
+                goto usage;
+            break;
+        case 'T': // seconds mdb-lookup-server may take to answer a lookup
+            backend_timeout = atoi(optarg);
+            if (backend_timeout <= 0)
+                goto usage;
+            break;
+        case 'm': // requests per connection; 1 disables persistent connections
+            max_requests = atoi(optarg);
+            if (max_requests <= 0)
+                goto usage;
+            break;
+        case 'N': // open client connections per worker; more get a 503
+            max_conns = atoi(optarg);
+            if (max_conns <= 0)
+                goto usage;
+            break;
+        case 'P': // lookups waiting or in flight per worker; more get a 503
+            max_lookups = atoi(optarg);
+            if (max_lookups <= 0)
+                goto usage;
+            break;
+        case 'Q': // connections the kernel queues for each worker to accept
+            backlog = atoi(optarg);
+            if (backlog <= 0)
+                goto usage;
+            break;
+        case 'c': // bytes of file cache per worker; 0 disables it
+            cache_size = parse_size(optarg);
+            if (cache_size < 0)
+                goto usage;
+            break;
+        case 'z': // bytes of gzip responses cached per worker; 0 disables gzip
+            gzip_cache_size = parse_size(optarg);
+            if (gzip_cache_size < 0)
+                goto usage;
+            break;
+        case 'w': // number of worker threads, each with its own event loop
+            workers = atoi(optarg);
+            if (workers <= 0)
+                goto usage;
+            break;
+        default:
+            goto usage;
+        }
     }
-    else {
-        status_code = handle_file_request(web_root, request_uri, clnt_w);
+
+    if (argc - optind != 4) {
+usage:
+        fprintf(stderr, "usage: %s [--workers <n>] [--cache-size <bytes>] "
+                "[--gzip-cache-size <bytes>] "
+                "[--keepalive-timeout <secs>] [--header-timeout <secs>] "
+                "[--write-timeout <secs>] [--backend-timeout <secs>] "
+                "[--max-requests <n>] [--max-conns <n>] [--max-lookups <n>] [--backlog <n>] "
+                "[--backend-conns <n>] "
+                "[--lookup-cache-size <bytes>] [--lookup-cache-ttl <secs>] [--binary-backend] "
+                "[--access-log <file>] [--log-sample <n>] [--cache-control <prefix>=<secs>]... "
+                "<http-port> <web-root> <mdb-host> <mdb-port>\n", argv[0]);
+        exit(1);
+    }
+
+    // Keep the pool well within what mdb-lookup-server takes on by default,
+    // however many workers there are.
+    if (backend_conns < 0) {
+        backend_conns = DEFAULT_BACKEND_POOL / workers;
+        if (backend_conns > DEFAULT_BACKEND_CONNS)
+            backend_conns = DEFAULT_BACKEND_CONNS;
+        if (backend_conns < 1)
+            backend_conns = 1;
+    }
+
+    char *http_port = argv[optind];
+    char *web_root = argv[optind + 1];
+    char *mdb_host = argv[optind + 2];
+    char *mdb_port = argv[optind + 3];
+
+    // Serve from the canonical web root, so that the paths of requested files
+    // are canonical too unless the request makes them otherwise; only those
+    // get inotify-watched cache entries (see file-cache.h).
+    static char real_root[PATH_MAX];
+    if (realpath(web_root, real_root) != NULL)
+        web_root = strcmp(real_root, "/") == 0 ? "" : real_root;
+
+    // Resolve the backend once; workers reconnect to this address without
+    // blocking on name lookups.
+    struct addrinfo hints, *info;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;       // Only accept IPv4 addresses
+    hints.ai_socktype = SOCK_STREAM; // stream socket for TCP connections
+    hints.ai_protocol = IPPROTO_TCP; // TCP protocol
+
+    int addr_err;
+    if ((addr_err = getaddrinfo(mdb_host, mdb_port, &hints, &info)) != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(addr_err));
+        exit(1);
     }
 
-terminate_connection:
+    // Every connection is a file descriptor; allow as many as we're permitted.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 
     /*
-     * Done with client request; close the connection and log the transaction.
+     * Set up every worker before starting any, so that configuration errors
+     * are reported before we serve anything.
      */
 
-    // Closing can FILE pointers can also produce errors, which we log.
-    if (fclose(clnt_w) < 0)
-        perror("send");
+    servers = calloc(workers, sizeof(*servers));
+    if (servers == NULL)
+        die("calloc");
+    nservers = workers;
+
+    for (int i = 0; i < workers; i++) {
+        servers[i].web_root = web_root;
+        memcpy(&servers[i].mdb_addr, info->ai_addr, info->ai_addrlen);
+        servers[i].mdb_addr_len = info->ai_addrlen;
+        servers[i].keepalive_timeout = keepalive_timeout;
+        servers[i].header_timeout = header_timeout;
+        servers[i].write_timeout = write_timeout;
+        servers[i].backend_timeout = backend_timeout;
+        servers[i].max_requests = max_requests;
+        servers[i].max_conns = max_conns;
+        servers[i].max_lookups = max_lookups;
+        servers[i].binary_backend = binary_backend;
+        servers[i].log_sample = log_sample;
+        servers[i].cache_rules = cache_rules;
+        servers[i].ncache_rules = ncache_rules;
+        server_init(&servers[i], http_port, cache_size, gzip_cache_size,
+                lookup_cache_size, lookup_cache_ttl, backend_conns, backlog);
+    }
+    freeaddrinfo(info);
+
+    struct log_ring **rings = malloc(workers * sizeof(*rings));
+    if (rings == NULL)
+        die("malloc");
+    for (int i = 0; i < workers; i++)
+        rings[i] = &servers[i].log;
+    if (access_log_start(access_log, rings, workers) < 0)
+        exit(1);
+
+    /*
+     * Start the workers. The main thread runs the last one itself.
+     */
 
-    if (fclose(clnt_r) < 0)
-        perror("recv");
+    for (int i = 0; i < workers - 1; i++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, &worker_main, &servers[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
 
-    fprintf(stderr, "%s \"%s %s %s\" %d %s\n",
-        clnt_ip,
-        method,
-        request_uri,
-        http_version,
-        status_code,
-        get_reason_phrase(status_code));
+        // Keep each worker on its own core so its connections stay cache-hot.
+        if (ncpus > 1) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % ncpus, &cpus);
+            pthread_setaffinity_np(tid, sizeof(cpus), &cpus);
+        }
     }
 
+    worker_main(&servers[workers - 1]);
+
     /*
      * UNREACHABLE
      */
 
-    close(serv_fd);
+    free(servers);
 
     return 0;
 }
-
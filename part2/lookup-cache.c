@@ -0,0 +1,92 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lookup-cache.h"
+
+// Bumped to invalidate every cache at once; entries from an older generation
+// are treated as missing.
+static atomic_uint generation;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void lookup_cache_release(struct lookup_cache_entry *e)
+{
+    if (--e->refs == 0)
+        free(e);
+}
+
+static void evict_entry(struct lru_entry *e)
+{
+    // lru is the first member of struct lookup_cache_entry
+    lookup_cache_release((struct lookup_cache_entry *)e);
+}
+
+int lookup_cache_init(struct lookup_cache *lc, size_t max_bytes, int ttl)
+{
+    memset(lc, 0, sizeof(*lc));
+    lc->ttl = ttl;
+    return lru_init(&lc->lru, max_bytes, &evict_entry);
+}
+
+void lookup_cache_key(char *dst, const char *key)
+{
+    size_t len = strcspn(key, "\r\n");
+    if (len > MDB_KEY_LEN)
+        len = MDB_KEY_LEN;
+    memcpy(dst, key, len);
+    dst[len] = '\0';
+}
+
+struct lookup_cache_entry *lookup_cache_get(struct lookup_cache *lc, const char *key)
+{
+    struct lookup_cache_entry *e = (struct lookup_cache_entry *)lru_get(&lc->lru, key);
+    if (e == NULL)
+        return NULL;
+
+    if (e->generation != atomic_load_explicit(&generation, memory_order_relaxed)
+            || e->expires <= now_ms()) {
+        lru_remove(&lc->lru, &e->lru);
+        return NULL;
+    }
+    return e;
+}
+
+struct lookup_cache_entry *lookup_cache_put(struct lookup_cache *lc, const char *key,
+        unsigned gen, const char *data, size_t len)
+{
+    if (gen != atomic_load_explicit(&generation, memory_order_relaxed))
+        return NULL;
+
+    struct lookup_cache_entry *e = malloc(sizeof(*e) + len);
+    if (e == NULL)
+        return NULL;
+
+    e->refs = 1;
+    e->expires = now_ms() + lc->ttl;
+    e->generation = gen;
+    e->len = len;
+    memcpy(e->data, data, len);
+
+    if (lru_put(&lc->lru, &e->lru, key, sizeof(*e) + len + strlen(key)) < 0) {
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+void lookup_cache_invalidate_all(void)
+{
+    atomic_fetch_add_explicit(&generation, 1, memory_order_relaxed);
+}
+
+unsigned lookup_cache_generation(void)
+{
+    return atomic_load_explicit(&generation, memory_order_relaxed);
+}
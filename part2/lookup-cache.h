@@ -0,0 +1,88 @@
+#ifndef __LOOKUP_CACHE_H__
+#define __LOOKUP_CACHE_H__
+
+#include "lru.h"
+
+/*
+ * mdb-lookup-server matches the whole key, but no record field is anywhere
+ * near this long, so a longer key matches nothing either way and we may cut
+ * it here. This is also the most the binary protocol takes (see
+ * mdb-proto.h).
+ */
+#define MDB_KEY_LEN 255
+
+/*
+ * In-memory cache of rendered /mdb-lookup results, keyed by the normalized
+ * lookup key (see lookup_cache_key()).
+ *
+ * Entries expire ttl milliseconds after they were stored. They are also
+ * dropped, in every worker at once, by lookup_cache_invalidate_all().
+ *
+ * Like file cache entries, entries are reference counted so that responses
+ * can be sent straight from them (see lookup_cache_hold()).
+ */
+struct lookup_cache_entry {
+    struct lru_entry lru;
+    int refs;            // the cache's own plus one per holder
+    long long expires;   // CLOCK_MONOTONIC milliseconds
+    unsigned generation; // lookup_cache_generation() when the lookup began
+    size_t len;
+    char data[];
+};
+
+struct lookup_cache {
+    struct lru lru;
+    int ttl; // milliseconds
+};
+
+/*
+ * Set up a cache holding at most max_bytes of results for ttl milliseconds
+ * each.
+ *
+ * Returns negative if failed.
+ */
+int lookup_cache_init(struct lookup_cache *lc, size_t max_bytes, int ttl);
+
+/*
+ * Normalize key the way mdb-lookup-server reads it: up to the end of the
+ * line, and at most MDB_KEY_LEN characters. dst must have room for
+ * MDB_KEY_LEN + 1 bytes.
+ */
+void lookup_cache_key(char *dst, const char *key);
+
+/*
+ * Returns the cached result for the normalized key, or NULL if we don't have
+ * a fresh one.
+ */
+struct lookup_cache_entry *lookup_cache_get(struct lookup_cache *lc, const char *key);
+
+/*
+ * Cache the result for the normalized key. generation is what
+ * lookup_cache_generation() returned before the lookup was sent, so that a
+ * result that raced with lookup_cache_invalidate_all() is not cached.
+ *
+ * Returns the new entry, or NULL if the result was not cached.
+ */
+struct lookup_cache_entry *lookup_cache_put(struct lookup_cache *lc, const char *key,
+        unsigned generation, const char *data, size_t len);
+
+static inline void lookup_cache_hold(struct lookup_cache_entry *e)
+{
+    e->refs++;
+}
+
+/*
+ * Drop a reference taken with lookup_cache_hold(), freeing e if it was the
+ * last.
+ */
+void lookup_cache_release(struct lookup_cache_entry *e);
+
+/*
+ * Make every cache in the process forget everything, e.g., because the
+ * database changed. Safe to call from any thread and from signal handlers.
+ */
+void lookup_cache_invalidate_all(void);
+
+unsigned lookup_cache_generation(void);
+
+#endif
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#include "lru.h"
+
+#define LRU_MIN_BUCKETS 64
+
+static uint32_t hash_key(const char *key)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    while (*key) {
+        h ^= (unsigned char)*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int lru_init(struct lru *c, size_t max_bytes, void (*evict)(struct lru_entry *e))
+{
+    memset(c, 0, sizeof(*c));
+    c->buckets = calloc(LRU_MIN_BUCKETS, sizeof(*c->buckets));
+    if (c->buckets == NULL)
+        return -1;
+    c->nbuckets = LRU_MIN_BUCKETS;
+    c->max_bytes = max_bytes;
+    c->evict = evict;
+    return 0;
+}
+
+void lru_destroy(struct lru *c)
+{
+    lru_clear(c);
+    free(c->buckets);
+    c->buckets = NULL;
+}
+
+static struct lru_entry **find_slot(struct lru *c, const char *key, uint32_t hash)
+{
+    struct lru_entry **slot = &c->buckets[hash & (c->nbuckets - 1)];
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->key, key)))
+        slot = &(*slot)->hnext;
+    return slot;
+}
+
+static void list_unlink(struct lru *c, struct lru_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+}
+
+static void list_push_front(struct lru *c, struct lru_entry *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head)
+        c->head->prev = e;
+    else
+        c->tail = e;
+    c->head = e;
+}
+
+/*
+ * Double the hash table once it averages more than one entry per bucket.
+ * Failing to grow only makes chains longer, so it is not an error.
+ */
+static void maybe_grow(struct lru *c)
+{
+    if (c->count <= c->nbuckets)
+        return;
+
+    size_t nbuckets = c->nbuckets * 2;
+    struct lru_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        struct lru_entry *e = c->buckets[i];
+        while (e) {
+            struct lru_entry *next = e->hnext;
+            e->hnext = buckets[e->hash & (nbuckets - 1)];
+            buckets[e->hash & (nbuckets - 1)] = e;
+            e = next;
+        }
+    }
+
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = nbuckets;
+}
+
+struct lru_entry *lru_get(struct lru *c, const char *key)
+{
+    struct lru_entry *e = *find_slot(c, key, hash_key(key));
+    if (e && e != c->head) {
+        list_unlink(c, e);
+        list_push_front(c, e);
+    }
+    return e;
+}
+
+int lru_put(struct lru *c, struct lru_entry *e, const char *key, size_t size)
+{
+    if (size > c->max_bytes)
+        return -1;
+
+    e->key = strdup(key);
+    if (e->key == NULL)
+        return -1;
+    e->hash = hash_key(key);
+    e->size = size;
+
+    struct lru_entry *old = *find_slot(c, key, e->hash);
+    if (old)
+        lru_remove(c, old);
+
+    while (c->bytes + size > c->max_bytes)
+        lru_remove(c, c->tail);
+
+    struct lru_entry **slot = find_slot(c, key, e->hash);
+    e->hnext = NULL;
+    *slot = e;
+    list_push_front(c, e);
+    c->count++;
+    c->bytes += size;
+
+    maybe_grow(c);
+    return 0;
+}
+
+void lru_remove(struct lru *c, struct lru_entry *e)
+{
+    struct lru_entry **slot = find_slot(c, e->key, e->hash);
+    *slot = e->hnext;
+    list_unlink(c, e);
+    c->count--;
+    c->bytes -= e->size;
+
+    free(e->key);
+    e->key = NULL;
+    c->evict(e);
+}
+
+void lru_clear(struct lru *c)
+{
+    while (c->tail)
+        lru_remove(c, c->tail);
+}
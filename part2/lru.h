@@ -0,0 +1,70 @@
+#ifndef __LRU_H__
+#define __LRU_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded least-recently-used cache keyed by strings.
+ *
+ * Entries are intrusive: embed a struct lru_entry as the first member of your
+ * own struct and the cache will hand it back to evict() when the entry is
+ * dropped, at which point the owner frees it. The cache is charged each
+ * entry's size in bytes and evicts from the cold end to stay within
+ * max_bytes.
+ *
+ * Not thread-safe; every http-server worker keeps its own caches.
+ */
+struct lru_entry {
+    char *key;                     // owned by the cache
+    uint32_t hash;
+    size_t size;                   // bytes charged against max_bytes
+    struct lru_entry *hnext;       // hash chain
+    struct lru_entry *prev, *next; // recency list, most recent first
+};
+
+struct lru {
+    struct lru_entry **buckets;
+    size_t nbuckets;
+    size_t count;
+    size_t bytes;
+    size_t max_bytes;
+    struct lru_entry *head, *tail;
+    void (*evict)(struct lru_entry *e);
+};
+
+/*
+ * Returns negative if out of memory.
+ */
+int lru_init(struct lru *c, size_t max_bytes, void (*evict)(struct lru_entry *e));
+
+/*
+ * Release every entry and the cache's own memory.
+ */
+void lru_destroy(struct lru *c);
+
+/*
+ * Returns the entry for key, marking it most recently used, or NULL.
+ */
+struct lru_entry *lru_get(struct lru *c, const char *key);
+
+/*
+ * Insert e under key, charged size bytes, replacing any existing entry with
+ * the same key and evicting cold entries until everything fits.
+ *
+ * Returns negative (and leaves e to the caller) if e can never fit or we're
+ * out of memory.
+ */
+int lru_put(struct lru *c, struct lru_entry *e, const char *key, size_t size);
+
+/*
+ * Drop e from the cache and hand it to evict().
+ */
+void lru_remove(struct lru *c, struct lru_entry *e);
+
+/*
+ * Drop every entry.
+ */
+void lru_clear(struct lru *c);
+
+#endif
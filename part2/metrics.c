@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+
+static const char *route_names[NROUTES] = { "static", "mdb", "other" };
+
+void metrics_observe(struct histogram *h, uint64_t us)
+{
+    // Round up to the next power of two, so bucket i gets (2^(i+3), 2^(i+4)].
+    int i = 0;
+    if (us > 1u << METRICS_MIN_SHIFT)
+        i = 64 - __builtin_clzll(us - 1) - METRICS_MIN_SHIFT;
+    if (i >= METRICS_BUCKETS)
+        i = METRICS_BUCKETS - 1;
+
+    metrics_add(&h->buckets[i], 1);
+    metrics_add(&h->count, 1);
+    metrics_add(&h->sum, us);
+}
+
+static uint64_t get(const _Atomic uint64_t *c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+/*
+ * Print the sum of one histogram across workers; offset is where it lives
+ * within struct metrics.
+ */
+static void render_histogram(FILE *fp, struct metrics *const *workers, int n,
+        size_t offset, const char *name, const char *labels)
+{
+    uint64_t buckets[METRICS_BUCKETS] = { 0 };
+    uint64_t count = 0, sum = 0;
+
+    for (int w = 0; w < n; w++) {
+        const struct histogram *h = (const void *)((const char *)workers[w] + offset);
+        for (int i = 0; i < METRICS_BUCKETS; i++)
+            buckets[i] += get(&h->buckets[i]);
+        count += get(&h->count);
+        sum += get(&h->sum);
+    }
+
+    const char *sep = *labels ? "," : "";
+
+    // Prometheus buckets are cumulative and in seconds.
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_BUCKETS - 1; i++) {
+        total += buckets[i];
+        fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                (double)(1ull << (i + METRICS_MIN_SHIFT)) / 1e6, (unsigned long long)total);
+    }
+    total += buckets[METRICS_BUCKETS - 1];
+    fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+            (unsigned long long)total);
+    const char *open = *labels ? "{" : "", *close = *labels ? "}" : "";
+    fprintf(fp, "%s_sum%s%s%s %g\n", name, open, labels, close, sum / 1e6);
+    fprintf(fp, "%s_count%s%s%s %llu\n", name, open, labels, close,
+            (unsigned long long)count);
+}
+
+char *metrics_render(struct metrics *const *workers, int n, size_t *len)
+{
+    char *data = NULL;
+    FILE *fp = open_memstream(&data, len);
+    if (fp == NULL)
+        return NULL;
+
+    fprintf(fp, "# HELP http_requests_total Requests answered, by route.\n"
+            "# TYPE http_requests_total counter\n");
+    for (int r = 0; r < NROUTES; r++) {
+        uint64_t total = 0;
+        for (int w = 0; w < n; w++)
+            total += get(&workers[w]->requests[r]);
+        fprintf(fp, "http_requests_total{route=\"%s\"} %llu\n", route_names[r],
+                (unsigned long long)total);
+    }
+
+    fprintf(fp, "# HELP http_responses_total Responses sent, by status code.\n"
+            "# TYPE http_responses_total counter\n");
+    for (int code = 0; code < 600; code++) {
+        uint64_t total = 0;
+        for (int w = 0; w < n; w++)
+            total += get(&workers[w]->status[code]);
+        if (total)
+            fprintf(fp, "http_responses_total{code=\"%d\"} %llu\n", code,
+                    (unsigned long long)total);
+    }
+
+    uint64_t bytes = 0, failures = 0, log_dropped = 0, shed = 0;
+    int64_t open_conns = 0;
+    for (int w = 0; w < n; w++) {
+        bytes += get(&workers[w]->bytes_sent);
+        failures += get(&workers[w]->backend_failures);
+        log_dropped += get(&workers[w]->log_dropped);
+        shed += get(&workers[w]->shed);
+        open_conns += atomic_load_explicit(&workers[w]->open_conns, memory_order_relaxed);
+    }
+
+    fprintf(fp, "# HELP http_sent_bytes_total Bytes of responses sent.\n"
+            "# TYPE http_sent_bytes_total counter\n"
+            "http_sent_bytes_total %llu\n", (unsigned long long)bytes);
+    fprintf(fp, "# HELP http_open_connections Client connections currently open.\n"
+            "# TYPE http_open_connections gauge\n"
+            "http_open_connections %lld\n", (long long)open_conns);
+    fprintf(fp, "# HELP mdb_backend_failures_total Backend connections dropped.\n"
+            "# TYPE mdb_backend_failures_total counter\n"
+            "mdb_backend_failures_total %llu\n", (unsigned long long)failures);
+    fprintf(fp, "# HELP http_access_log_dropped_total Access log lines dropped because "
+            "the log buffer was full.\n"
+            "# TYPE http_access_log_dropped_total counter\n"
+            "http_access_log_dropped_total %llu\n", (unsigned long long)log_dropped);
+    fprintf(fp, "# HELP http_shed_total Connections and lookups turned away with 503 "
+            "because the server was at its limit.\n"
+            "# TYPE http_shed_total counter\n"
+            "http_shed_total %llu\n", (unsigned long long)shed);
+
+    fprintf(fp, "# HELP http_request_duration_seconds Time from reading a request "
+            "to sending its response.\n"
+            "# TYPE http_request_duration_seconds histogram\n");
+    for (int r = 0; r < NROUTES; r++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "route=\"%s\"", route_names[r]);
+        render_histogram(fp, workers, n, offsetof(struct metrics, latency)
+                + r * sizeof(struct histogram),
+                "http_request_duration_seconds", labels);
+    }
+
+    fprintf(fp, "# HELP mdb_backend_rtt_seconds Time from sending a request to "
+            "mdb-lookup-server to receiving its answer.\n"
+            "# TYPE mdb_backend_rtt_seconds histogram\n");
+    render_histogram(fp, workers, n, offsetof(struct metrics, backend_rtt),
+            "mdb_backend_rtt_seconds", "");
+
+    if (fclose(fp) != 0) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
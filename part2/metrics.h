@@ -0,0 +1,80 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Request metrics for /server-status.
+ *
+ * Every http-server worker keeps its own struct metrics and is the only one
+ * that ever updates it, so recording takes no locks and no atomic
+ * read-modify-write instructions: the counters are atomics only so that the
+ * worker rendering /server-status may read another worker's counters while
+ * they change. A reader may see a request counted in one metric and not yet
+ * in another, which is fine for monitoring.
+ */
+
+enum metrics_route {
+    ROUTE_STATIC, // files under web-root
+    ROUTE_MDB,    // /mdb-lookup and /mdb-add
+    ROUTE_OTHER,  // /server-status, and requests rejected before routing
+    NROUTES
+};
+
+/*
+ * Bucket i of a histogram counts observations of up to 2^(i + 4)
+ * microseconds (16 us to about 17 s); the last bucket takes everything
+ * longer.
+ */
+#define METRICS_BUCKETS 22
+#define METRICS_MIN_SHIFT 4
+
+struct histogram {
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum; // microseconds
+};
+
+struct metrics {
+    _Atomic uint64_t requests[NROUTES];
+    _Atomic uint64_t status[600]; // responses by status code
+    _Atomic uint64_t bytes_sent;
+    _Atomic int64_t open_conns;
+    _Atomic uint64_t backend_failures; // backend connections dropped
+    _Atomic uint64_t log_dropped;      // access log lines that didn't fit
+    _Atomic uint64_t shed;             // connections and lookups turned away with 503
+    struct histogram latency[NROUTES]; // request read to response sent
+    struct histogram backend_rtt;      // mdb lookup sent to answer received
+};
+
+/*
+ * Add n to counter c. Only the owning worker may call this.
+ */
+static inline void metrics_add(_Atomic uint64_t *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+static inline void metrics_gauge_add(_Atomic int64_t *g, int64_t n)
+{
+    atomic_store_explicit(g, atomic_load_explicit(g, memory_order_relaxed) + n,
+            memory_order_relaxed);
+}
+
+/*
+ * Record an observation of us microseconds in h.
+ */
+void metrics_observe(struct histogram *h, uint64_t us);
+
+/*
+ * Render the sum of n workers' metrics in the Prometheus text exposition
+ * format, into a malloc'ed buffer whose length is stored in *len.
+ *
+ * Returns NULL if out of memory.
+ */
+char *metrics_render(struct metrics *const *workers, int n, size_t *len);
+
+#endif
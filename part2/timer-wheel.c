@@ -0,0 +1,157 @@
+#include <limits.h>
+
+#include "timer-wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Ticks spanned by all levels together.
+#define WHEEL_SPAN (1LL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+void timer_wheel_init(struct timer_wheel *w, long long now)
+{
+    w->now = now;
+    w->count = 0;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            struct timer *head = &w->slots[level][i];
+            head->prev = head->next = head;
+        }
+    }
+}
+
+void timer_init(struct timer *t, void (*fn)(void *arg), void *arg)
+{
+    t->prev = t->next = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+/*
+ * Put t in the slot for its expiry, relative to where the wheel is now.
+ */
+static void wheel_add(struct timer_wheel *w, struct timer *t)
+{
+    long long expires = t->expires < w->now ? w->now : t->expires;
+    long long delta = expires - w->now;
+
+    // Too far out to place; park it on the last slot in reach, from which it
+    // is cascaded and placed again.
+    if (delta >= WHEEL_SPAN)
+        expires = w->now + WHEEL_SPAN - 1, delta = WHEEL_SPAN - 1;
+
+    int level = 0;
+    while (delta >> (TIMER_WHEEL_BITS * (level + 1)))
+        level++;
+
+    struct timer *head =
+        &w->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    w->count++;
+}
+
+static void wheel_unlink(struct timer_wheel *w, struct timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    w->count--;
+}
+
+void timer_arm(struct timer_wheel *w, struct timer *t, long long expires)
+{
+    if (timer_armed(t))
+        wheel_unlink(w, t);
+    t->expires = expires;
+    wheel_add(w, t);
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t)
+{
+    if (timer_armed(t))
+        wheel_unlink(w, t);
+}
+
+/*
+ * Move every timer in slot i of level down to the levels below it.
+ */
+static void cascade(struct timer_wheel *w, int level, int i)
+{
+    struct timer *head = &w->slots[level][i];
+
+    while (head->next != head) {
+        struct timer *t = head->next;
+        wheel_unlink(w, t);
+        wheel_add(w, t);
+    }
+}
+
+void timer_wheel_advance(struct timer_wheel *w, long long now)
+{
+    while (w->now <= now) {
+        // Nothing to run, and no slot position to keep track of.
+        if (w->count == 0) {
+            w->now = now + 1;
+            return;
+        }
+
+        // At the start of each turn of a level, the next slot up comes down.
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((w->now >> (TIMER_WHEEL_BITS * (level - 1))) & SLOT_MASK)
+                break;
+            cascade(w, level, (w->now >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+        }
+
+        struct timer *head = &w->slots[0][w->now & SLOT_MASK];
+        while (head->next != head) {
+            struct timer *t = head->next;
+            wheel_unlink(w, t);
+            if (t->expires > w->now) {
+                // Parked beyond the wheel's reach; it has further to go.
+                wheel_add(w, t);
+                continue;
+            }
+            t->fn(t->arg);
+        }
+
+        w->now++;
+    }
+}
+
+int timer_wheel_timeout(const struct timer_wheel *w, long long now)
+{
+    if (w->count == 0)
+        return -1;
+
+    long long next = LLONG_MAX;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        long long turn = w->now >> shift; // slots of this level gone by
+        int cur = turn & SLOT_MASK;
+
+        for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+            const struct timer *head = &w->slots[level][i];
+            if (head->next == head)
+                continue;
+
+            // When the slot comes up: its timers are due on level 0, and
+            // cascaded on the others. The current slot of a higher level
+            // comes up only on the next turn, unless it is just starting.
+            long long ahead = (i - cur) & SLOT_MASK;
+            if (level > 0 && ahead == 0 && (w->now & ((1LL << shift) - 1)))
+                ahead = TIMER_WHEEL_SLOTS;
+            long long t = (turn + ahead) << shift;
+            if (t < next)
+                next = t;
+        }
+    }
+
+    // w->now is the first tick not yet run; anything before it is overdue.
+    if (next <= now)
+        return 0;
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
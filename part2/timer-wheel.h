@@ -0,0 +1,81 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stddef.h>
+
+/*
+ * Hierarchical timer wheel with millisecond ticks.
+ *
+ * Level 0 has a slot for each of the next TIMER_WHEEL_SLOTS milliseconds;
+ * each slot of level n covers a whole turn of level n - 1. A timer goes into
+ * the lowest level whose span reaches its expiry, and as time comes up on a
+ * slot of a higher level, its timers are moved down a level (cascaded).
+ * Arming and canceling a timer is a list insert or unlink, however many
+ * timers there are, so connections can re-arm theirs on every request without
+ * the event loop ever sorting or scanning them. Timers further out than the
+ * wheel reaches (about 4.6 hours) go round again until they are due.
+ *
+ * Timers are intrusive: embed a struct timer in whatever it times out.
+ *
+ * Not thread-safe; every http-server worker keeps its own wheel.
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer {
+    struct timer *prev, *next; // slot list; next is NULL while not armed
+    long long expires;         // ms
+    void (*fn)(void *arg);     // called once expires has come
+    void *arg;
+};
+
+struct timer_wheel {
+    long long now; // the next tick to run (ms)
+    size_t count;  // timers armed
+    struct timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // list heads
+};
+
+/*
+ * Start w at now (ms, on the clock every later call uses).
+ */
+void timer_wheel_init(struct timer_wheel *w, long long now);
+
+/*
+ * Get t ready to arm; it will call fn(arg) when it expires.
+ */
+void timer_init(struct timer *t, void (*fn)(void *arg), void *arg);
+
+/*
+ * Have t expire at expires (ms), replacing whatever it was armed for before.
+ * An expiry already past fires on the next timer_wheel_advance().
+ */
+void timer_arm(struct timer_wheel *w, struct timer *t, long long expires);
+
+/*
+ * Disarm t if it is armed.
+ */
+void timer_cancel(struct timer_wheel *w, struct timer *t);
+
+static inline int timer_armed(const struct timer *t)
+{
+    return t->next != NULL;
+}
+
+/*
+ * Fire every timer that has expired by now, in order of expiry. A timer is
+ * disarmed before its function is called, so the function may arm it again,
+ * or arm and cancel any other timer.
+ */
+void timer_wheel_advance(struct timer_wheel *w, long long now);
+
+/*
+ * Returns the number of milliseconds from now until timer_wheel_advance()
+ * next has work to do, for use as an epoll_wait() timeout, or -1 if no timer
+ * is armed. The wait may end before the next timer is due, where timers have
+ * to be cascaded first.
+ */
+int timer_wheel_timeout(const struct timer_wheel *w, long long now);
+
+#endif